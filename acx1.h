@@ -19,6 +19,8 @@ typedef unsigned short int  uint16_t;
 typedef   signed short int   int16_t;
 typedef unsigned int        uint32_t;
 typedef   signed int         int32_t;
+typedef unsigned __int64    uint64_t;
+typedef   signed __int64     int64_t;
 # else
 #   include <stdint.h>
 #   include <unistd.h>
@@ -167,12 +169,18 @@ typedef unsigned int uint_t;
 #define ACX1_LIGHT_CYAN         (6 | ACX1_LIGHT)
 #define ACX1_WHITE              (7 | ACX1_LIGHT)
 
+/* 24-bit colour; terminals without it get the nearest palette entry */
+#define ACX1_RGB                0x01000000
+#define ACX1_RGB_COLOR(_r, _g, _b) \
+  (ACX1_RGB | ((_r) << 16) | ((_g) << 8) | (_b))
+
 /* event_types **************************************************************/
 #define ACX1_NONE               0
 #define ACX1_RESIZE             1
 #define ACX1_KEY                2
 #define ACX1_ERROR              3
 #define ACX1_FINISH             4
+#define ACX1_PASTE              5
 
 typedef struct acx1_event_s acx1_event_t;
 struct acx1_event_s
@@ -185,6 +193,13 @@ struct acx1_event_s
     {
       uint16_t w, h;
     } size;
+    // text pasted in the terminal, utf8 as it came with a 0 after it; valid
+    // until the next acx1_read_event(s)() call
+    struct
+    {
+      uint8_t const * data;
+      size_t len;
+    } paste;
   };
 };
 
@@ -202,6 +217,35 @@ struct acx1_attr_s
   uint32_t mode;
 };
 
+/* a row of acx1_rect_rows() text: len bytes of utf8 with the same \a
+ * escapes as acx1_rect(), no terminator needed */
+typedef struct acx1_row_s acx1_row_t;
+struct acx1_row_s
+{
+  uint8_t const * data;
+  size_t len;
+};
+
+/* acx1_init_ex() flags ***************************************************/
+#define ACX1_NO_THREAD          (1 << 0) /**< Input read on the app's thread. */
+
+/* terminal capabilities **************************************************/
+#define ACX1_CAP_BCE            (1 << 0) /**< Erasing uses the background. */
+#define ACX1_CAP_ECH            (1 << 1) /**< Erase characters (CSI n X). */
+#define ACX1_CAP_REP            (1 << 2) /**< Repeat last char (CSI n b). */
+#define ACX1_CAP_SYNC           (1 << 3) /**< Synchronized update (2026). */
+#define ACX1_CAP_256            (1 << 4) /**< 256 colour palette. */
+#define ACX1_CAP_RGB            (1 << 5) /**< 24-bit colour (SGR 38;2). */
+
+typedef struct acx1_stats_s acx1_stats_t;
+struct acx1_stats_s
+{
+  uint64_t write_calls; // write() system calls made on the terminal
+  uint64_t write_bytes; // bytes sent to the terminal
+  uint64_t frames; // completed acx1_write_start/acx1_write_stop pairs
+  uint64_t events_dropped; // input events lost (the queue could not grow)
+};
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -212,8 +256,39 @@ ACX1_API char const * ACX1_CALL acx1_status_str (unsigned int status);
 ACX1_API void acx1_logging (int level, FILE * lf);
 ACX1_API void * ACX1_CALL acx1_key_name (void * out, uint32_t km, int mode);
 ACX1_API unsigned int ACX1_CALL acx1_init ();
+
+/* acx1_init() with ACX1_xxx flags; with ACX1_NO_THREAD no worker thread is
+ * started and input is decoded by acx1_process_input(), called when the fd
+ * from acx1_get_input_fd() is readable (acx1_read_events() does this too);
+ * SIGWINCH is blocked in the calling thread until acx1_finish() and, in
+ * both modes, a handler passes it on from threads that do not block it */
+ACX1_API unsigned int ACX1_CALL acx1_init_ex (uint32_t flags);
+ACX1_API unsigned int ACX1_CALL acx1_get_input_fd (int * fd_p);
+ACX1_API unsigned int ACX1_CALL acx1_process_input ();
+
+/* with ACX1_NO_THREAD: ms after which acx1_process_input() has to be called
+ * even if no input comes, to end the wait after ESC; -1 if there is none */
+ACX1_API unsigned int ACX1_CALL acx1_get_input_timeout (int * ms_p);
+
+/* ESC also starts the sequences of other keys so it is taken as the Esc key
+ * only when nothing follows it for ms milliseconds (50 by default); with 0 it
+ * is decided at the end of what the terminal sent */
+ACX1_API unsigned int ACX1_CALL acx1_set_esc_timeout (unsigned int ms);
 ACX1_API void ACX1_CALL acx1_finish ();
 ACX1_API unsigned int ACX1_CALL acx1_read_event (acx1_event_t * event_p);
+
+/* stores up to max pending events and their number in *count_p; waits up to
+ * timeout_ms for the first one (forever if negative, not at all if 0) and
+ * returns ACX1_OK with *count_p = 0 on timeout; once the tty is gone and the
+ * keys before that were read, it gives an ACX1_ERROR event and the error */
+ACX1_API unsigned int ACX1_CALL acx1_read_events
+(
+  acx1_event_t * events,
+  unsigned int max,
+  int timeout_ms,
+  unsigned int * count_p
+);
+
 ACX1_API unsigned int ACX1_CALL acx1_set_cursor_mode (uint8_t mode);
 ACX1_API unsigned int ACX1_CALL acx1_get_cursor_mode (uint8_t * mode_p);
 ACX1_API unsigned int ACX1_CALL acx1_set_cursor_pos (uint16_t r, uint16_t c);
@@ -226,7 +301,40 @@ ACX1_API unsigned int ACX1_CALL acx1_write_pos (uint16_t r, uint16_t c);
 ACX1_API unsigned int ACX1_CALL acx1_write (void const * data, size_t len);
 ACX1_API unsigned int ACX1_CALL acx1_fill (uint32_t ch, uint16_t count);
 ACX1_API unsigned int ACX1_CALL acx1_clear ();
+/* blanks h rows of w cells starting at (r, c) using the current attributes;
+ * the write position is undefined afterwards */
+ACX1_API unsigned int ACX1_CALL acx1_clear_rect
+(
+  uint16_t r,
+  uint16_t c,
+  uint16_t h,
+  uint16_t w
+);
+
+/* moves the content of rows top..bottom up by n rows (down if n < 0); the
+ * rows left behind are blanked and should be redrawn by the caller */
+ACX1_API unsigned int ACX1_CALL acx1_scroll
+(
+  uint16_t top,
+  uint16_t bottom,
+  int n
+);
+
 ACX1_API unsigned int ACX1_CALL acx1_write_stop ();
+ACX1_API unsigned int ACX1_CALL acx1_flush ();
+ACX1_API unsigned int ACX1_CALL acx1_get_stats (acx1_stats_t * stats_p);
+
+/* capabilities are guessed from the environment by acx1_init() and from
+ * what the terminal replies to queries; call acx1_set_caps() after
+ * acx1_init() to override them */
+ACX1_API unsigned int ACX1_CALL acx1_get_caps (uint32_t * caps_p);
+ACX1_API unsigned int ACX1_CALL acx1_set_caps (uint32_t caps);
+
+/* retained mode: writes go to an off-screen cell grid and only the cells
+ * that differ from the last presented frame are sent to the terminal when
+ * calling acx1_present() or acx1_write_stop() */
+ACX1_API unsigned int ACX1_CALL acx1_retained_mode (unsigned int enable);
+ACX1_API unsigned int ACX1_CALL acx1_present ();
 
 ACX1_API unsigned int ACX1_CALL acx1_rect
 (
@@ -238,7 +346,37 @@ ACX1_API unsigned int ACX1_CALL acx1_rect
   acx1_attr_t * attrs
 );
 
+/* same as acx1_rect() but the first col_ofs display columns of each row are
+ * skipped, for horizontal scrolling; a wide char cut by the left edge shows
+ * as a space */
+ACX1_API unsigned int ACX1_CALL acx1_rect_ofs
+(
+  uint8_t const * const * data,
+  uint16_t start_row,
+  uint16_t start_col,
+  uint16_t row_num,
+  uint16_t col_num,
+  uint32_t col_ofs,
+  acx1_attr_t * attrs
+);
+
+/* same as acx1_rect_ofs() but rows are given as (pointer, length) pairs;
+ * widths is optional and holds the display width of each row (escapes not
+ * counted) so rows that fit or are scrolled out of view need no measuring */
+ACX1_API unsigned int ACX1_CALL acx1_rect_rows
+(
+  acx1_row_t const * rows,
+  uint32_t const * widths,
+  uint16_t start_row,
+  uint16_t start_col,
+  uint16_t row_num,
+  uint16_t col_num,
+  uint32_t col_ofs,
+  acx1_attr_t * attrs
+);
+
 ACX1_API void * ACX1_CALL acx1_hexz (void * out, void const * in, size_t len);
+ACX1_API int ACX1_CALL acx1_utf8_char_encode (void * out, uint32_t cp);
 ACX1_API int ACX1_CALL acx1_utf8_char_decode_strict
 (
   void const * vdata,
@@ -246,6 +384,11 @@ ACX1_API int ACX1_CALL acx1_utf8_char_decode_strict
   uint32_t * out
 );
 
+/* returns the length of the longest valid utf8 prefix of data, so len when
+ * all of it is valid; overlongs, surrogates, code points past U+10FFFF and a
+ * sequence cut by the end of data are invalid */
+ACX1_API size_t ACX1_CALL acx1_utf8_validate (void const * data, size_t len);
+
 ACX1_API int ACX1_CALL acx1_utf8_str_measure
 (
   int (ACX1_CALL * wf) (uint32_t cp, void * ctx),
@@ -261,6 +404,10 @@ ACX1_API int ACX1_CALL acx1_utf8_str_measure
 
 ACX1_API int ACX1_CALL acx1_term_char_width_wctx (uint32_t cp, void * ctx);
 
+/* java modified utf8 (NUL as C0 80, chars past U+FFFF as two 3-byte
+ * surrogates) to utf16; stores up to out_n units and counts the units for
+ * all of the input, so out_n 0 gives the size needed; returns 0 or a negative
+ * error with *in_len_p at the bad char */
 ACX1_API int ACX1_CALL acx1_mutf8_str_decode
 (
   void const * vdata,
@@ -271,8 +418,44 @@ ACX1_API int ACX1_CALL acx1_mutf8_str_decode
   size_t * out_len_p
 );
 
+/* standard utf8 to utf16 (with surrogate pairs) or utf32; returns 0 when all
+ * input was converted, 1 when out_a is full and -1 at invalid utf8; *in_len_p
+ * and *out_len_p get the bytes used and the units stored (nothing is written
+ * past them); with out_a NULL only the units needed for the valid part of the
+ * input are counted */
+ACX1_API int ACX1_CALL acx1_utf8_to_utf16
+(
+  void const * data,
+  size_t len,
+  uint16_t * out_a,
+  size_t out_n,
+  size_t * in_len_p,
+  size_t * out_len_p
+);
+ACX1_API int ACX1_CALL acx1_utf8_to_utf32
+(
+  void const * data,
+  size_t len,
+  uint32_t * out_a,
+  size_t out_n,
+  size_t * in_len_p,
+  size_t * out_len_p
+);
+
 ACX1_API int ACX1_CALL acx1_term_char_width (uint32_t cp);
 
+/* total width of n code points or (size_t) -1 if any of them has no width;
+ * widths is optional and gets the width of each (-1 for no width) */
+ACX1_API size_t ACX1_CALL acx1_term_str_width_u32
+(
+  uint32_t const * cps,
+  size_t n,
+  int8_t * widths
+);
+
+/* nearest entry to 0xRRGGBB in the xterm palette of 256 or 16 colours */
+ACX1_API int ACX1_CALL acx1_rgb_to_index (uint32_t rgb, unsigned int colours);
+
 #ifdef __cplusplus
 };
 #endif
@@ -10,17 +10,77 @@
 #include <stdio.h>
 #include "acx1.h"
 
+/* the avx2 utf8 kernel is built with a target attribute and picked at run
+ * time, so it needs no special compiler flags */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || __clang__)
+# define ACX1_AVX2 1
+#else
+# define ACX1_AVX2 0
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# define ACX1_SSE2 1
+#else
+# define ACX1_SSE2 0
+#endif
+
+#if ACX1_AVX2
+# include <immintrin.h>
+#elif ACX1_SSE2
+# include <emmintrin.h>
+#endif
+
 extern unsigned char acx1_ucw_ofs_a[];
 extern unsigned char acx1_ucw_val_a[];
 
 static char acx1_digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
 
+/* xterm default values for the 16 basic colours */
+static uint8_t const basic_rgb_a[16][3] =
+{
+  {   0,   0,   0 }, { 205,   0,   0 }, {   0, 205,   0 }, { 205, 205,   0 },
+  {   0,   0, 238 }, { 205,   0, 205 }, {   0, 205, 205 }, { 229, 229, 229 },
+  { 127, 127, 127 }, { 255,   0,   0 }, {   0, 255,   0 }, { 255, 255,   0 },
+  {  92,  92, 255 }, { 255,   0, 255 }, {   0, 255, 255 }, { 255, 255, 255 },
+};
+
+/* channel levels of the 6x6x6 cube in the 256 colour palette */
+static uint8_t const cube_level_a[6] = { 0, 95, 135, 175, 215, 255 };
+
+/* nearest palette entry for every colour with 5 bits per channel: [0] for
+ * the 256 colour palette, [1] for the 16 basic colours; filled on first use */
+static uint8_t rgb_lut_a[2][0x8000];
+static char rgb_lut_ready = 0;
+
 /* acx1_hexz *****************************************************************/
 ACX1_API void * ACX1_CALL acx1_hexz (void * out, void const * in, size_t len)
 {
   uint8_t const * i = in;
   uint8_t const * ie = i + len;
   uint8_t * o = out;
+#if ACX1_SSE2
+  __m128i x, hi, lo, m, nine, c0, c7;
+
+  // digit = nibble + '0', plus 7 more for nibbles above 9 to reach 'A'
+  m = _mm_set1_epi8(0x0F);
+  nine = _mm_set1_epi8(9);
+  c0 = _mm_set1_epi8('0');
+  c7 = _mm_set1_epi8(7);
+  for (; ie - i >= 16; i += 16, o += 32)
+  {
+    x = _mm_loadu_si128((__m128i const *) i);
+    hi = _mm_and_si128(_mm_srli_epi16(x, 4), m);
+    lo = _mm_and_si128(x, m);
+    hi = _mm_add_epi8(_mm_add_epi8(hi, c0),
+                      _mm_and_si128(_mm_cmpgt_epi8(hi, nine), c7));
+    lo = _mm_add_epi8(_mm_add_epi8(lo, c0),
+                      _mm_and_si128(_mm_cmpgt_epi8(lo, nine), c7));
+    _mm_storeu_si128((__m128i *) o, _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *) (o + 16), _mm_unpackhi_epi8(hi, lo));
+  }
+#endif
 
   for (; i < ie; ++i)
   {
@@ -41,6 +101,36 @@ ACX1_API int ACX1_CALL acx1_utf8_char_len (uint32_t cp)
   return -1;
 }
 
+/* acx1_utf8_char_encode *****************************************************/
+ACX1_API int ACX1_CALL acx1_utf8_char_encode (void * vout, uint32_t cp)
+{
+  uint8_t * o = vout;
+  if (cp < 0x80) { o[0] = cp; return 1; }
+  if (cp < 0x800)
+  {
+    o[0] = 0xC0 | (cp >> 6);
+    o[1] = 0x80 | (cp & 0x3F);
+    return 2;
+  }
+  if (cp < 0x10000)
+  {
+    if ((cp & 0xF800) == 0xD800) return -3;
+    o[0] = 0xE0 | (cp >> 12);
+    o[1] = 0x80 | ((cp >> 6) & 0x3F);
+    o[2] = 0x80 | (cp & 0x3F);
+    return 3;
+  }
+  if (cp < 0x110000)
+  {
+    o[0] = 0xF0 | (cp >> 18);
+    o[1] = 0x80 | ((cp >> 12) & 0x3F);
+    o[2] = 0x80 | ((cp >> 6) & 0x3F);
+    o[3] = 0x80 | (cp & 0x3F);
+    return 4;
+  }
+  return -1;
+}
+
 /* acx1_utf8_char_decode_raw *************************************************/
 ACX1_API int ACX1_CALL acx1_utf8_char_decode_raw
 (
@@ -131,11 +221,260 @@ ACX1_API int ACX1_CALL acx1_utf8_char_decode_strict
   l = acx1_utf8_char_decode_raw(vdata, len, out);
   if (l < 0) return l;
   if (acx1_utf8_char_len(*out) != l) return -8;
-  if (l >= 0x110000) return -9;
-  if ((l & 0xFFF800) == 0x00D800) return -10;
+  if (*out >= 0x110000) return -9;
+  if ((*out & 0xFFF800) == 0x00D800) return -10;
   return l;
 }
 
+#if ACX1_AVX2
+/* utf8_avx2_prefix *********************************************************/
+/* validates 32-byte blocks with the nibble lookup tables from Keiser and
+ * Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte"; returns
+ * the offset of the first block with an error or of the tail that is shorter
+ * than a block; the caller finds the exact spot one char at a time */
+#define UV_TOO_SHORT (1 << 0)
+#define UV_TOO_LONG (1 << 1)
+#define UV_OVERLONG_3 (1 << 2)
+#define UV_TOO_LARGE (1 << 3)
+#define UV_SURROGATE (1 << 4)
+#define UV_OVERLONG_2 (1 << 5)
+#define UV_TOO_LARGE_1000 (1 << 6)
+#define UV_OVERLONG_4 (1 << 6)
+#define UV_TWO_CONTS (1 << 7)
+#define UV_CARRY (UV_TOO_SHORT | UV_TOO_LONG | UV_TWO_CONTS)
+#define UV_T16(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+__attribute__((target("avx2")))
+static size_t utf8_avx2_prefix (uint8_t const * d, size_t len)
+{
+  __m256i const nib = _mm256_set1_epi8(0x0F);
+  __m256i const b1h_t = UV_T16(
+    // 0_______ : ascii in byte 1
+    UV_TOO_LONG, UV_TOO_LONG, UV_TOO_LONG, UV_TOO_LONG,
+    UV_TOO_LONG, UV_TOO_LONG, UV_TOO_LONG, UV_TOO_LONG,
+    // 10______ : continuation in byte 1
+    UV_TWO_CONTS, UV_TWO_CONTS, UV_TWO_CONTS, UV_TWO_CONTS,
+    // 1100____, 1101____ : 2 byte leads
+    UV_TOO_SHORT | UV_OVERLONG_2,
+    UV_TOO_SHORT,
+    // 1110____ : 3 byte lead
+    UV_TOO_SHORT | UV_OVERLONG_3 | UV_SURROGATE,
+    // 1111____ : 4 byte lead or worse
+    UV_TOO_SHORT | UV_TOO_LARGE | UV_TOO_LARGE_1000 | UV_OVERLONG_4);
+  __m256i const b1l_t = UV_T16(
+    UV_CARRY | UV_OVERLONG_3 | UV_OVERLONG_2 | UV_OVERLONG_4,
+    UV_CARRY | UV_OVERLONG_2,
+    UV_CARRY,
+    UV_CARRY,
+    UV_CARRY | UV_TOO_LARGE,
+    UV_CARRY | UV_TOO_LARGE | UV_TOO_LARGE_1000,
+    UV_CARRY | UV_TOO_LARGE | UV_TOO_LARGE_1000,
+    UV_CARRY | UV_TOO_LARGE | UV_TOO_LARGE_1000,
+    UV_CARRY | UV_TOO_LARGE | UV_TOO_LARGE_1000,
+    UV_CARRY | UV_TOO_LARGE | UV_TOO_LARGE_1000,
+    UV_CARRY | UV_TOO_LARGE | UV_TOO_LARGE_1000,
+    UV_CARRY | UV_TOO_LARGE | UV_TOO_LARGE_1000,
+    UV_CARRY | UV_TOO_LARGE | UV_TOO_LARGE_1000,
+    UV_CARRY | UV_TOO_LARGE | UV_TOO_LARGE_1000 | UV_SURROGATE,
+    UV_CARRY | UV_TOO_LARGE | UV_TOO_LARGE_1000,
+    UV_CARRY | UV_TOO_LARGE | UV_TOO_LARGE_1000);
+  __m256i const b2h_t = UV_T16(
+    // 0_______ : ascii in byte 2
+    UV_TOO_SHORT, UV_TOO_SHORT, UV_TOO_SHORT, UV_TOO_SHORT,
+    UV_TOO_SHORT, UV_TOO_SHORT, UV_TOO_SHORT, UV_TOO_SHORT,
+    // 1000____
+    UV_TOO_LONG | UV_OVERLONG_2 | UV_TWO_CONTS | UV_OVERLONG_3 |
+    UV_TOO_LARGE_1000 | UV_OVERLONG_4,
+    // 1001____
+    UV_TOO_LONG | UV_OVERLONG_2 | UV_TWO_CONTS | UV_OVERLONG_3 |
+    UV_TOO_LARGE,
+    // 101_____
+    UV_TOO_LONG | UV_OVERLONG_2 | UV_TWO_CONTS | UV_SURROGATE |
+    UV_TOO_LARGE,
+    UV_TOO_LONG | UV_OVERLONG_2 | UV_TWO_CONTS | UV_SURROGATE |
+    UV_TOO_LARGE,
+    // 11______ : lead in byte 2
+    UV_TOO_SHORT, UV_TOO_SHORT, UV_TOO_SHORT, UV_TOO_SHORT);
+  // a block ending in a lead byte needs the next one to finish it
+  __m256i const max_t = _mm256_setr_epi8(
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    (char) 0xEF, (char) 0xDF, (char) 0xBF);
+  __m256i prev, in, sh, p1, p2, p3, sc, err;
+  size_t i;
+
+  prev = _mm256_setzero_si256();
+  for (i = 0; len - i >= 32; i += 32)
+  {
+    in = _mm256_loadu_si256((__m256i const *) (d + i));
+    if (!_mm256_movemask_epi8(in))
+    {
+      err = _mm256_subs_epu8(prev, max_t);
+      if (!_mm256_testz_si256(err, err)) break;
+      prev = in;
+      continue;
+    }
+    sh = _mm256_permute2x128_si256(prev, in, 0x21);
+    p1 = _mm256_alignr_epi8(in, sh, 15);
+    p2 = _mm256_alignr_epi8(in, sh, 14);
+    p3 = _mm256_alignr_epi8(in, sh, 13);
+    sc = _mm256_and_si256(
+        _mm256_and_si256(
+            _mm256_shuffle_epi8(b1h_t, _mm256_and_si256(
+                    _mm256_srli_epi16(p1, 4), nib)),
+            _mm256_shuffle_epi8(b1l_t, _mm256_and_si256(p1, nib))),
+        _mm256_shuffle_epi8(b2h_t, _mm256_and_si256(
+                _mm256_srli_epi16(in, 4), nib)));
+    // 3rd and 4th bytes of a sequence must be continuations
+    err = _mm256_and_si256(
+        _mm256_or_si256(_mm256_subs_epu8(p2, _mm256_set1_epi8(0x60)),
+                        _mm256_subs_epu8(p3, _mm256_set1_epi8(0x70))),
+        _mm256_set1_epi8((char) 0x80));
+    err = _mm256_xor_si256(err, sc);
+    if (!_mm256_testz_si256(err, err)) break;
+    prev = in;
+  }
+  return i;
+}
+#endif
+
+/* acx1_utf8_validate ********************************************************/
+ACX1_API size_t ACX1_CALL acx1_utf8_validate (void const * vdata, size_t len)
+{
+  uint8_t const * d = vdata;
+  size_t i = 0;
+#if ACX1_AVX2
+  size_t j;
+#endif
+  uint_t c, n, k, lo, hi;
+#if ACX1_SSE2
+  __m128i v;
+#else
+  uint64_t x;
+#endif
+
+#if ACX1_AVX2
+  if (len >= 0x40 && __builtin_cpu_supports("avx2"))
+  {
+    i = utf8_avx2_prefix(d, len);
+    // resume at the start of the last char before that offset since it may
+    // run into the block with the error or be cut by the end of data
+    if (i)
+    {
+      for (j = i - 1; j && i - j < 4 && (d[j] & 0xC0) == 0x80; --j);
+      i = j;
+    }
+  }
+#endif
+
+  while (i < len)
+  {
+    // skip ascii a vector at a time
+#if ACX1_SSE2
+    for (; len - i >= 16; i += 16)
+    {
+      v = _mm_loadu_si128((__m128i const *) (d + i));
+      if (_mm_movemask_epi8(v)) break;
+    }
+#else
+    for (; len - i >= 8; i += 8)
+    {
+      memcpy(&x, d + i, 8);
+      if (x & 0x8080808080808080ULL) break;
+    }
+#endif
+    // then one char at a time until the next ascii char; the ranges for the
+    // second byte are the ones in table 3-7 of the unicode standard
+    for (; i < len; i += n + 1)
+    {
+      c = d[i];
+      if (c < 0x80)
+      {
+        ++i;
+        break;
+      }
+      if (c < 0xC2) return i;
+      if (c < 0xE0) { n = 1; lo = 0x80; hi = 0xBF; }
+      else if (c < 0xF0)
+      {
+        n = 2;
+        lo = c == 0xE0 ? 0xA0 : 0x80;
+        hi = c == 0xED ? 0x9F : 0xBF;
+      }
+      else if (c < 0xF5)
+      {
+        n = 3;
+        lo = c == 0xF0 ? 0x90 : 0x80;
+        hi = c == 0xF4 ? 0x8F : 0xBF;
+      }
+      else return i;
+      if (len - i <= n || d[i + 1] < lo || d[i + 1] > hi) return i;
+      for (k = 2; k <= n; ++k)
+        if ((d[i + k] & 0xC0) != 0x80) return i;
+    }
+  }
+  return len;
+}
+
+#if ACX1_AVX2
+/* ascii_run_avx2 ***********************************************************/
+__attribute__((target("avx2")))
+static size_t ascii_run_avx2 (uint8_t const * d, size_t n)
+{
+  __m256i v;
+  uint32_t m;
+  size_t i;
+
+  for (i = 0; n - i >= 32; i += 32)
+  {
+    v = _mm256_loadu_si256((__m256i const *) (d + i));
+    // bytes >= 0x80 are negative so they count as below the space
+    m = _mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), v),
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7F))));
+    if (m) return i + __builtin_ctz(m);
+  }
+  return i;
+}
+#endif
+
+/* ascii_run ****************************************************************/
+/* returns how many of the first n bytes are printable ascii in a row */
+static size_t ascii_run (uint8_t const * d, size_t n)
+{
+  size_t i = 0;
+#if ACX1_SSE2
+  __m128i v;
+#else
+  uint64_t x;
+#endif
+
+#if ACX1_AVX2
+  if (n >= 0x40 && __builtin_cpu_supports("avx2"))
+  {
+    i = ascii_run_avx2(d, n);
+    if (n - i >= 32) return i;
+  }
+#endif
+#if ACX1_SSE2
+  for (; n - i >= 16; i += 16)
+  {
+    v = _mm_loadu_si128((__m128i const *) (d + i));
+    if (_mm_movemask_epi8(_mm_or_si128(
+            _mm_cmplt_epi8(v, _mm_set1_epi8(0x20)),
+            _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F))))) break;
+  }
+#else
+  for (; n - i >= 8; i += 8)
+  {
+    memcpy(&x, d + i, 8);
+    if (((x - 0x2020202020202020ULL) | x | (x + 0x0101010101010101ULL))
+        & 0x8080808080808080ULL) break;
+  }
+#endif
+  for (; i < n && d[i] >= 0x20 && d[i] < 0x7F; ++i);
+  return i;
+}
+
 /* acx1_utf8_str_measure *****************************************************/
 ACX1_API int ACX1_CALL acx1_utf8_str_measure
 (
@@ -151,7 +490,7 @@ ACX1_API int ACX1_CALL acx1_utf8_str_measure
 )
 {
   int rc, l, k;
-  size_t lb, lc, lw, cb, cc, cw;
+  size_t lb, lc, lw, cb, cc, cw, n;
   uint32_t ch;
   uint8_t const * d;
 
@@ -159,6 +498,23 @@ ACX1_API int ACX1_CALL acx1_utf8_str_measure
   d = data;
   for (; cb < b; lb = cb, lc = cc, lw = cw)
   {
+    if (wf == acx1_term_char_width_wctx)
+    {
+      // printable ascii is one byte, one code point and one column each;
+      // stop at the limits so the char past them goes the slow way below
+      n = b - cb;
+      if (n > c - cc) n = c - cc;
+      if (n > w - cw) n = w - cw;
+      n = ascii_run(d, n);
+      cb += n;
+      cc += n;
+      cw += n;
+      d += n;
+      lb = cb;
+      lc = cc;
+      lw = cw;
+      if (cb == b) break;
+    }
     l = acx1_utf8_char_decode_strict(d, b - cb, &ch);
     if (l <= 0) { rc = -1; goto l_ret; }
     cb += l;
@@ -179,16 +535,104 @@ l_ret:
   return rc;
 }
 
+/* 2-bit width entry for cp < 0x110000; 3 means no width */
+#define UCW_BITS(_cp) \
+  ((acx1_ucw_val_a[(((uint_t) acx1_ucw_ofs_a[(_cp) >> 8]) << 6) \
+                   + (((_cp) >> 2) & 0x3F)] >> (2 * ((_cp) & 3))) & 3)
+
 /* acx1_term_char_width ******************************************************/
 ACX1_API int ACX1_CALL acx1_term_char_width (uint32_t cp)
 {
   int b;
 
-  b = (acx1_ucw_val_a[(((uint_t) acx1_ucw_ofs_a[cp >> 8]) << 6)
-                    + ((cp >> 2) & 0x3F)] >> (2 * (cp & 3))) & 3;
+  if (cp >= 0x110000) return -1;
+  b = UCW_BITS(cp);
   return b == 3 ? -1 : b;
 }
 
+/* acx1_term_str_width_u32 ***************************************************/
+ACX1_API size_t ACX1_CALL acx1_term_str_width_u32
+(
+  uint32_t const * cps,
+  size_t n,
+  int8_t * widths
+)
+{
+  static int8_t const w_a[4] = { 0, 1, 2, -1 };
+  size_t i, total = 0;
+  uint_t b, bad = 0;
+  uint32_t cp, oor;
+
+  for (i = 0; i < n; ++i)
+  {
+    // out of range code points look up U+0000 and are forced to no width
+    cp = cps[i];
+    oor = cp >= 0x110000;
+    cp = oor ? 0 : cp;
+    b = UCW_BITS(cp) | (oor * 3);
+    bad |= b == 3;
+    total += b;
+    if (widths) widths[i] = w_a[b];
+  }
+  return bad ? (size_t) -1 : total;
+}
+
+/* rgb_dist *****************************************************************/
+static uint32_t rgb_dist (int r, int g, int b, int pr, int pg, int pb)
+{
+  return 2 * (r - pr) * (r - pr) + 4 * (g - pg) * (g - pg) +
+    3 * (b - pb) * (b - pb);
+}
+
+/* rgb_lut_init *************************************************************/
+static void rgb_lut_init ()
+{
+  uint_t k, i, best, cube[3];
+  int c[3], l;
+  uint32_t d, bd;
+
+  for (k = 0; k < 0x8000; ++k)
+  {
+    for (i = 0; i < 3; ++i)
+    {
+      l = (k >> (10 - 5 * i)) & 0x1F;
+      c[i] = (l << 3) | (l >> 2);
+      // the nearest level for each channel gives the nearest cube entry
+      for (cube[i] = 0; cube[i] < 5 &&
+           c[i] * 2 > cube_level_a[cube[i]] + cube_level_a[cube[i] + 1];
+           ++cube[i]);
+    }
+    best = 16 + cube[0] * 36 + cube[1] * 6 + cube[2];
+    bd = rgb_dist(c[0], c[1], c[2], cube_level_a[cube[0]],
+                  cube_level_a[cube[1]], cube_level_a[cube[2]]);
+    for (i = 0; i < 24; ++i)
+    {
+      l = 8 + 10 * i;
+      d = rgb_dist(c[0], c[1], c[2], l, l, l);
+      if (d < bd) { bd = d; best = 232 + i; }
+    }
+    rgb_lut_a[0][k] = best;
+
+    for (i = 0, best = 0, bd = 0xFFFFFFFF; i < 16; ++i)
+    {
+      d = rgb_dist(c[0], c[1], c[2], basic_rgb_a[i][0], basic_rgb_a[i][1],
+                   basic_rgb_a[i][2]);
+      if (d < bd) { bd = d; best = i; }
+    }
+    rgb_lut_a[1][k] = best;
+  }
+  rgb_lut_ready = 1;
+}
+
+/* acx1_rgb_to_index ********************************************************/
+ACX1_API int ACX1_CALL acx1_rgb_to_index (uint32_t rgb, unsigned int colours)
+{
+  if (!rgb_lut_ready) rgb_lut_init();
+  return rgb_lut_a[colours < 256][((rgb >> 9) & 0x7C00) |
+                                  ((rgb >> 6) & 0x03E0) |
+                                  ((rgb >> 3) & 0x001F)];
+}
+
 /* acx1_term_char_width_wctx *************************************************/
 ACX1_API int ACX1_CALL acx1_term_char_width_wctx (uint32_t cp, void * ctx)
 {
@@ -196,6 +640,269 @@ ACX1_API int ACX1_CALL acx1_term_char_width_wctx (uint32_t cp, void * ctx)
   return acx1_term_char_width(cp);
 }
 
+/* utf8_units *************************************************************/
+/* counts the utf16 (wide 2) or utf32 (wide 4) units of valid utf8: one for
+ * each byte that is not a continuation plus one for each 4-byte lead when
+ * making utf16 surrogate pairs */
+static size_t utf8_units (uint8_t const * d, size_t len, int wide)
+{
+  size_t i = 0, n = 0;
+#if ACX1_SSE2
+  __m128i v, acc, lead_min, f0, z;
+  uint_t k;
+
+  // continuations are -128..-65 as signed bytes; 4-byte leads are the ones
+  // left unchanged by an unsigned max with 0xF0; matches are -1 so they are
+  // subtracted into byte counters that are summed before they can overflow
+  lead_min = _mm_set1_epi8(-65);
+  f0 = _mm_set1_epi8((char) 0xF0);
+  z = _mm_setzero_si128();
+  while (len - i >= 16)
+  {
+    acc = z;
+    for (k = 0; k < 0x7F && len - i >= 16; ++k, i += 16)
+    {
+      v = _mm_loadu_si128((__m128i const *) (d + i));
+      acc = _mm_sub_epi8(acc, _mm_cmpgt_epi8(v, lead_min));
+      if (wide == 2)
+        acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_max_epu8(v, f0), v));
+    }
+    acc = _mm_sad_epu8(acc, z);
+    n += (size_t) _mm_cvtsi128_si32(acc) +
+         (size_t) _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+  }
+#endif
+  for (; i < len; ++i)
+    n += ((d[i] & 0xC0) != 0x80) + (wide == 2 && d[i] >= 0xF0);
+  return n;
+}
+
+/* ascii_widen **************************************************************/
+/* stores the ascii bytes at the start of d, up to n of them and stopping at
+ * a 0 if nonul is set, as utf16 (wide 2) or utf32 (wide 4) units; returns
+ * how many */
+static size_t ascii_widen
+(
+  uint8_t const * d,
+  size_t n,
+  void * out_a,
+  int wide,
+  int nonul
+)
+{
+  uint16_t * o16 = out_a;
+  uint32_t * o32 = out_a;
+  size_t i = 0;
+#if ACX1_SSE2
+  __m128i x, z, lo, hi;
+
+  z = _mm_setzero_si128();
+  for (; n - i >= 16; i += 16)
+  {
+    x = _mm_loadu_si128((__m128i const *) (d + i));
+    if (_mm_movemask_epi8(nonul ? _mm_or_si128(x, _mm_cmpeq_epi8(x, z)) : x))
+      break;
+    lo = _mm_unpacklo_epi8(x, z);
+    hi = _mm_unpackhi_epi8(x, z);
+    if (wide == 2)
+    {
+      _mm_storeu_si128((__m128i *) (o16 + i), lo);
+      _mm_storeu_si128((__m128i *) (o16 + i + 8), hi);
+    }
+    else
+    {
+      _mm_storeu_si128((__m128i *) (o32 + i), _mm_unpacklo_epi16(lo, z));
+      _mm_storeu_si128((__m128i *) (o32 + i + 4), _mm_unpackhi_epi16(lo, z));
+      _mm_storeu_si128((__m128i *) (o32 + i + 8), _mm_unpacklo_epi16(hi, z));
+      _mm_storeu_si128((__m128i *) (o32 + i + 12), _mm_unpackhi_epi16(hi, z));
+    }
+  }
+#endif
+  // the rest one byte at a time, so nothing is stored past the ascii
+  for (; i < n && d[i] < 0x80 && (d[i] || !nonul); ++i)
+    if (wide == 2) o16[i] = d[i];
+    else o32[i] = d[i];
+  return i;
+}
+
+/* utf8_to_wide *************************************************************/
+static int utf8_to_wide
+(
+  uint8_t const * d,
+  size_t len,
+  void * out_a,
+  size_t out_n,
+  int wide,
+  size_t * in_len_p,
+  size_t * out_len_p
+)
+{
+  uint16_t * o16 = out_a;
+  uint32_t * o32 = out_a;
+  size_t i, o, v;
+  uint32_t cp, c;
+  int l, rc;
+
+  if (!out_a)
+  {
+    v = acx1_utf8_validate(d, len);
+    if (in_len_p) *in_len_p = v;
+    if (out_len_p) *out_len_p = utf8_units(d, v, wide);
+    return v == len ? 0 : -1;
+  }
+
+  for (i = o = 0; i < len; )
+  {
+    // runs of ascii in bulk
+    v = len - i < out_n - o ? len - i : out_n - o;
+    if (wide == 2) v = ascii_widen(d + i, v, o16 + o, 2, 0);
+    else v = ascii_widen(d + i, v, o32 + o, 4, 0);
+    i += v;
+    o += v;
+    // then one char at a time until ascii goes on for more than a byte
+    while (i < len)
+    {
+      if (o == out_n) { rc = 1; goto l_exit; }
+      if (d[i] < 0x80)
+      {
+        if (wide == 2) o16[o++] = d[i];
+        else o32[o++] = d[i];
+        ++i;
+        if (i < len && d[i] < 0x80) break;
+        continue;
+      }
+      c = d[i];
+      // 2 and 3 byte chars inline, with the second byte ranges of table 3-7
+      if (c >= 0xC2 && c < 0xE0 && len - i >= 2 && (d[i + 1] & 0xC0) == 0x80)
+      {
+        cp = ((c & 0x1F) << 6) | (d[i + 1] & 0x3F);
+        l = 2;
+      }
+      else if (c >= 0xE0 && c < 0xF0 && len - i >= 3 &&
+               d[i + 1] >= (c == 0xE0 ? 0xA0 : 0x80) &&
+               d[i + 1] <= (c == 0xED ? 0x9F : 0xBF) &&
+               (d[i + 2] & 0xC0) == 0x80)
+      {
+        cp = ((c & 0x0F) << 12) | ((d[i + 1] & 0x3F) << 6) | (d[i + 2] & 0x3F);
+        l = 3;
+      }
+      else
+      {
+        l = acx1_utf8_char_decode_strict(d + i, len - i, &cp);
+        if (l < 0) { rc = -1; goto l_exit; }
+      }
+      if (wide == 4) o32[o++] = cp;
+      else if (cp < 0x10000) o16[o++] = (uint16_t) cp;
+      else
+      {
+        if (out_n - o < 2) { rc = 1; goto l_exit; }
+        cp -= 0x10000;
+        o16[o++] = (uint16_t) (0xD800 | (cp >> 10));
+        o16[o++] = (uint16_t) (0xDC00 | (cp & 0x3FF));
+      }
+      i += l;
+    }
+  }
+  rc = 0;
+l_exit:
+  if (in_len_p) *in_len_p = i;
+  if (out_len_p) *out_len_p = o;
+  return rc;
+}
+
+/* acx1_utf8_to_utf16 *******************************************************/
+ACX1_API int ACX1_CALL acx1_utf8_to_utf16
+(
+  void const * data,
+  size_t len,
+  uint16_t * out_a,
+  size_t out_n,
+  size_t * in_len_p,
+  size_t * out_len_p
+)
+{
+  return utf8_to_wide(data, len, out_a, out_n, 2, in_len_p, out_len_p);
+}
+
+/* acx1_utf8_to_utf32 *******************************************************/
+ACX1_API int ACX1_CALL acx1_utf8_to_utf32
+(
+  void const * data,
+  size_t len,
+  uint32_t * out_a,
+  size_t out_n,
+  size_t * in_len_p,
+  size_t * out_len_p
+)
+{
+  return utf8_to_wide(data, len, out_a, out_n, 4, in_len_p, out_len_p);
+}
+
+/* mutf8_char ***************************************************************/
+/* decodes a java modified utf8 char: NUL is C0 80, surrogates are allowed
+ * and there are no 4-byte chars; returns its length or a negative error as
+ * acx1_utf8_char_decode_raw() */
+static int mutf8_char (uint8_t const * d, size_t n, uint32_t * cp_p)
+{
+  uint32_t cp, c = d[0];
+  int l;
+
+  if (c >= 0xC2 && c < 0xE0 && n >= 2 && (d[1] & 0xC0) == 0x80)
+  {
+    *cp_p = ((c & 0x1F) << 6) | (d[1] & 0x3F);
+    return 2;
+  }
+  if (c >= 0xE0 && c < 0xF0 && n >= 3 && d[1] >= (c == 0xE0 ? 0xA0 : 0x80) &&
+      d[1] <= 0xBF && (d[2] & 0xC0) == 0x80)
+  {
+    *cp_p = ((c & 0x0F) << 12) | ((d[1] & 0x3F) << 6) | (d[2] & 0x3F);
+    return 3;
+  }
+  // ascii, C0 80 and the errors
+  l = acx1_utf8_char_decode_raw(d, n, &cp);
+  if (l < 0) return l;
+  if (cp >= 0x10000) return -9;
+  if (!cp)
+  {
+    if (l != 2) return (l == 1) ? -10 : -8;
+  }
+  else if (acx1_utf8_char_len(cp) != l) return -8;
+  *cp_p = cp;
+  return l;
+}
+
+/* mutf8_valid **************************************************************/
+/* returns the length of the valid java modified utf8 at the start of d */
+static size_t mutf8_valid (uint8_t const * d, size_t len)
+{
+  size_t i = 0;
+  uint32_t cp;
+  int l;
+#if ACX1_SSE2
+  __m128i x, z;
+
+  z = _mm_setzero_si128();
+#endif
+  while (i < len)
+  {
+#if ACX1_SSE2
+    // skip 16 bytes at a time while they are ascii without NULs
+    for (; len - i >= 16; i += 16)
+    {
+      x = _mm_loadu_si128((__m128i const *) (d + i));
+      if (_mm_movemask_epi8(_mm_or_si128(x, _mm_cmpeq_epi8(x, z)))) break;
+    }
+    if (i == len) break;
+#endif
+    if (d[i] && d[i] < 0x80) { ++i; continue; }
+    l = mutf8_char(d + i, len - i, &cp);
+    if (l < 0) break;
+    i += l;
+  }
+  return i;
+}
+
+/* acx1_mutf8_str_decode ****************************************************/
 ACX1_API int ACX1_CALL acx1_mutf8_str_decode
 (
   void const * vdata,
@@ -210,35 +917,33 @@ ACX1_API int ACX1_CALL acx1_mutf8_str_decode
   uint8_t const * e = d + len;
   uint32_t cp;
   int l;
-  size_t olen;
+  size_t olen, n;
 
-  for (olen = 0; d < e && olen < out_n; d += l, ++olen)
+  for (olen = 0; d < e && olen < out_n; )
   {
-    l = acx1_utf8_char_decode_raw(d, e - d, &cp);
+    n = (size_t) (e - d) < out_n - olen ? (size_t) (e - d) : out_n - olen;
+    n = ascii_widen(d, n, out_a + olen, 2, 1);
+    d += n;
+    olen += n;
+    if (d == e || olen == out_n) break;
+    l = mutf8_char(d, e - d, &cp);
     if (l < 0) goto l_exitio;
-    if (cp >= 0x10000) { l = -9; goto l_exitio; }
-    if (!cp)
-    {
-      if (l != 2) { l = (l == 1) ? -10 : -8; goto l_exitio; }
-    }
-    else if (acx1_utf8_char_len(cp) != l) { l = -8; goto l_exitio; }
-    out_a[olen] = (uint16_t) cp;
+    out_a[olen++] = (uint16_t) cp;
+    d += l;
   }
 
   if (in_len_p) *in_len_p = d - (uint8_t const *) vdata;
   if (d < e)
   {
-    // output full, just count from now on...
-    for (; d < e; d += l, ++olen)
+    // output full: check the rest and count it in bulk, one unit for each
+    // char as there are no 4-byte ones
+    n = mutf8_valid(d, e - d);
+    olen += utf8_units(d, n, 4);
+    d += n;
+    if (d < e)
     {
-      l = acx1_utf8_char_decode_raw(d, e - d, &cp);
-      if (l < 0) goto l_exitio;
-      if (cp >= 0x10000) { l = -9; goto l_exitio; }
-      if (!cp)
-      {
-        if (l != 2) { l = (l == 1) ? -10 : -8; goto l_exitio; }
-      }
-      else if (acx1_utf8_char_len(cp) != l) { l = -8; goto l_exitio; }
+      l = mutf8_char(d, e - d, &cp);
+      goto l_exitio;
     }
   }
 
@@ -394,3 +1099,64 @@ char * escstr (char * out, size_t out_len, void const * buf, size_t len)
   return out;
 }
 
+
+/* rect_row_skip ************************************************************/
+/* skips the first n display columns of an acx1_rect() row of len bytes;
+ * *ofs_p gets the byte offset where drawing continues and *attr_p the
+ * attribute index selected by the skipped \a escapes (left untouched if
+ * there were none); *split_p is set when a wide char straddles the left edge
+ * so the caller can draw a space for its right half; returns -1 on malformed
+ * data */
+int rect_row_skip
+(
+  uint8_t const * row,
+  size_t len,
+  size_t n,
+  size_t * ofs_p,
+  int * attr_p,
+  int * split_p
+)
+{
+  size_t o = 0;
+  uint64_t x;
+  uint32_t cp;
+  int l, cw;
+
+  *split_p = 0;
+  for (;;)
+  {
+    // plain ascii needs neither decoding nor width lookup; take 8 bytes at a
+    // time while none of them is a control char, DEL or above 0x7F
+    for (; n >= 8 && len - o >= 8; o += 8, n -= 8)
+    {
+      memcpy(&x, row + o, 8);
+      if (((x - 0x2020202020202020ULL) | x | (x + 0x0101010101010101ULL))
+          & 0x8080808080808080ULL) break;
+    }
+    while (n && o < len && row[o] >= 0x20 && row[o] < 0x7F) ++o, --n;
+    if (o == len) break;
+    if (row[o] == '\a')
+    {
+      if (len - o < 2) break;
+      *attr_p = row[o + 1];
+      o += 2;
+      continue;
+    }
+    if (row[o] < 0x80)
+    {
+      if (!n) break;
+      return -1;
+    }
+    l = acx1_utf8_char_decode_strict(row + o, len - o, &cp);
+    if (l < 0) return -1;
+    cw = acx1_term_char_width(cp);
+    if (cw < 0) return -1;
+    // combining marks right after the edge belong to the skipped char
+    if (!n && cw) break;
+    o += l;
+    if ((size_t) cw > n) { *split_p = 1; n = 0; }
+    else n -= cw;
+  }
+  *ofs_p = o;
+  return 0;
+}
@@ -0,0 +1,155 @@
+/* acx1 - Application Console Interface - ver. 1
+ *
+ * Microbenchmark for the escape sequence builders of gnulinux.c.
+ * Times the cursor position (CUP) and attribute (SGR) sequences as built by
+ * the library against the sprintf based builders they replaced, after
+ * checking that both give the same bytes.
+ *
+ * Usage: escbench [iterations]
+ *
+ * The builders are static so gnulinux.c is compiled in; nothing touches the
+ * terminal.
+ */
+#include "gnulinux.c"
+
+#define CHECK_N 100000
+#define INPUT_N 0x400 // power of 2
+
+typedef struct input_s input_t;
+struct input_s
+{
+  uint16_t r, c;
+  int sgr[8];
+  int sgr_n;
+};
+
+static input_t input_a[INPUT_N];
+static uint32_t rnd_state = 1;
+static volatile uint8_t sink;
+
+/* rnd **********************************************************************/
+static uint32_t rnd ()
+{
+  rnd_state = rnd_state * 1103515245 + 12345;
+  return rnd_state >> 8;
+}
+
+/* old_cup_str **************************************************************/
+static uint_t old_cup_str (uint8_t * buf, uint16_t r, uint16_t c)
+{
+  if (c == 1) return r == 1 ? sprintf((char *) buf, "\e[H")
+                            : sprintf((char *) buf, "\e[%uH", r);
+  return sprintf((char *) buf, "\e[%u;%uH", r, c);
+}
+
+/* old_sgr_str **************************************************************/
+static uint_t old_sgr_str (uint8_t * buf, int const * ia, int in)
+{
+  int o, k;
+
+  buf[0] = 0x1B;
+  buf[1] = '[';
+  o = 2;
+  for (k = 0; k < in; ++k, o += strlen((char *) &buf[o]))
+  {
+    sprintf((char *) &buf[o], "%u;", ia[k]);
+  }
+  buf[o - 1] = 'm';
+  return o;
+}
+
+/* fill_input ***************************************************************/
+/* screen positions and the SGR shapes written by attr_update_str: 16
+ * colours, 256 colours and 24-bit colours */
+static void fill_input (input_t * in)
+{
+  int * s = in->sgr;
+
+  in->r = 1 + rnd() % 100;
+  in->c = 1 + rnd() % 300;
+  s[0] = 0;
+  switch (rnd() % 3)
+  {
+  case 0:
+    s[1] = 40 + rnd() % 8;
+    s[2] = 90 + rnd() % 8;
+    s[3] = 1;
+    in->sgr_n = 4;
+    break;
+  case 1:
+    s[1] = 48; s[2] = 5; s[3] = rnd() % 256;
+    s[4] = 38; s[5] = 5; s[6] = rnd() % 256;
+    s[7] = 1;
+    in->sgr_n = 8;
+    break;
+  default:
+    s[1] = 38; s[2] = 2;
+    s[3] = rnd() % 256; s[4] = rnd() % 256; s[5] = rnd() % 256;
+    in->sgr_n = 6;
+  }
+}
+
+/* now_ns *******************************************************************/
+static double now_ns ()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* main *********************************************************************/
+int main (int argc, char * * argv)
+{
+  uint8_t a[0x80], b[0x80];
+  uint_t al, bl, i, n = 10000000;
+  input_t * in;
+  double t[4];
+  int k;
+
+  if (argc > 1) n = strtoul(argv[1], NULL, 0);
+
+  for (i = 0; i < CHECK_N; ++i)
+  {
+    input_t x;
+    fill_input(&x);
+    al = old_cup_str(a, x.r, x.c);
+    bl = set_cursor_pos_str(b, x.r, x.c);
+    if (al != bl || memcmp(a, b, al))
+    {
+      fprintf(stderr, "CUP %u;%u differs\n", x.r, x.c);
+      return 1;
+    }
+    al = old_sgr_str(a, x.sgr, x.sgr_n);
+    bl = sgr_str(b, x.sgr, x.sgr_n);
+    if (al != bl || memcmp(a, b, al))
+    {
+      fprintf(stderr, "SGR with %d numbers differs\n", x.sgr_n);
+      return 1;
+    }
+  }
+  for (i = 0; i < INPUT_N; ++i) fill_input(&input_a[i]);
+
+  for (k = 0; k < 4; ++k)
+  {
+    t[k] = now_ns();
+    for (i = 0; i < n; ++i)
+    {
+      in = &input_a[i & (INPUT_N - 1)];
+      switch (k)
+      {
+      case 0: al = old_cup_str(a, in->r, in->c); break;
+      case 1: al = set_cursor_pos_str(a, in->r, in->c); break;
+      case 2: al = old_sgr_str(a, in->sgr, in->sgr_n); break;
+      default: al = sgr_str(a, in->sgr, in->sgr_n);
+      }
+      sink += a[al - 1];
+    }
+    t[k] = (now_ns() - t[k]) / n;
+  }
+
+  printf("%u sequences each, output checked on %u inputs\n", n, CHECK_N);
+  printf("CUP  sprintf %7.1f ns  table %7.1f ns\n", t[0], t[1]);
+  printf("SGR  sprintf %7.1f ns  table %7.1f ns\n", t[2], t[3]);
+  return 0;
+}
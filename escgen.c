@@ -0,0 +1,278 @@
+/* acx1 - Application Console Interface - ver. 1
+ *
+ * Generator for esctab.inc, the tables of the escape sequence decoder in
+ * gnulinux.c.
+ *
+ * Usage: escgen escseq.txt > esctab.inc
+ *
+ * The sequences from escseq.txt are put in a trie that starts after ESC;
+ * digits are not part of it: a run of digits is a number, so every node
+ * with a number edge goes to a node that loops on digits. Sequences with
+ * the same shape (same bytes, numbers anywhere) end in the same leaf and
+ * the leaf lists the entries with their number values to try in order.
+ *
+ * The output has:
+ *  - esc_class_a: byte classes for 0..0x7F; bytes that lead to the same
+ *    nodes share a class, 0 has no edges and ESC_DIGIT_CLASS is for digits;
+ *  - esc_next_a: next node for each node and class, 0 meaning none (the
+ *    root, node 0, is never entered through an edge);
+ *  - esc_node_a: node flags and the range of entries of leaves;
+ *  - esc_ent_a: the entries.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_NODES 0x100
+#define MAX_ENTS 0x400
+#define MAX_NUMS 2 // ESC_NUMS in gnulinux.c
+#define ANY 0xFFFF // ESC_ANY in gnulinux.c
+
+#define NF_NUM 1 // entered by digits
+#define NF_CSI 2 // after ESC [
+#define NF_LEAF 4
+
+typedef struct node_s node_t;
+struct node_s
+{
+  unsigned char next[0x80]; // by byte; digits use next['0']
+  unsigned int flags;
+};
+
+typedef struct ent_s ent_t;
+struct ent_s
+{
+  char key[0x80]; // C expression; empty for replies
+  char const * reply;
+  unsigned int v[MAX_NUMS];
+  unsigned int mod; // 1 + index of the <m> number
+  unsigned int leaf;
+  unsigned int ln;
+};
+
+static node_t node_a[MAX_NODES];
+static unsigned int node_n = 1;
+static ent_t ent_a[MAX_ENTS];
+static unsigned int ent_n = 0;
+static unsigned char class_a[0x80];
+static unsigned int class_n;
+
+/* edge *********************************************************************/
+/* returns the node after b from node n, adding it if needed; 0 if full */
+static unsigned int edge (unsigned int n, unsigned int b)
+{
+  unsigned int m;
+
+  if (node_a[n].next[b]) return node_a[n].next[b];
+  if (node_n == MAX_NODES) return 0;
+  m = node_n++;
+  node_a[n].next[b] = m;
+  node_a[m].flags = node_a[n].flags & NF_CSI;
+  if (n == 0 && b == '[') node_a[m].flags |= NF_CSI;
+  if (b == '0')
+  {
+    node_a[m].flags |= NF_NUM;
+    node_a[m].next['0'] = m;
+  }
+  return m;
+}
+
+/* parse_key ****************************************************************/
+/* turns "SHIFT|F1" into "ACX1_SHIFT | ACX1_F1" */
+static int parse_key (char const * s, char * out, size_t size)
+{
+  size_t i = 0, l;
+
+  for (;;)
+  {
+    l = strcspn(s, "|");
+    if (!l || i + l + 9 >= size) return 1;
+    memcpy(out + i, "ACX1_", 5);
+    memcpy(out + i + 5, s, l);
+    i += 5 + l;
+    s += l;
+    if (!*s) break;
+    memcpy(out + i, " | ", 3);
+    i += 3;
+    ++s;
+  }
+  out[i] = 0;
+  return 0;
+}
+
+/* parse_line ***************************************************************/
+static int parse_line (char * line, unsigned int ln)
+{
+  ent_t * e;
+  char * s;
+  char * k;
+  unsigned int n = 0, c, nn = 0, v, b = 0;
+
+  s = line + strcspn(line, " \t");
+  if (!*s) return 1;
+  *s++ = 0;
+  s += strspn(s, " \t");
+  k = s;
+  s[strcspn(s, " \t\r\n")] = 0;
+  if (!*k || strncmp(line, "\\e", 2) || !line[2]) return 1;
+  if (ent_n == MAX_ENTS) return 1;
+  e = &ent_a[ent_n++];
+  e->ln = ln;
+  e->mod = 0;
+  for (c = 0; c < MAX_NUMS; ++c) e->v[c] = ANY;
+
+  if (!strcmp(k, "@CPR")) e->reply = "REPORT_CURSOR_POSITION_REPLY";
+  else if (!strcmp(k, "@MODE")) e->reply = "REPORT_MODE_REPLY";
+  else if (!strcmp(k, "@PASTE")) e->reply = "PASTE_START_REPLY";
+  else if (*k == '@' || parse_key(k, e->key, sizeof(e->key))) return 1;
+  else e->reply = NULL;
+
+  for (s = line + 2; *s; b = c)
+  {
+    c = (unsigned char) *s;
+    if (c >= 0x80 || c < 0x20 || c == '\\') return 1;
+    if ((c >= '0' && c <= '9') || c == '<')
+    {
+      // a number after a number or right after ESC cannot be told apart
+      if (nn == MAX_NUMS || n == 0 || b == '0') return 1;
+      if (c == '<')
+      {
+        if (!strncmp(s, "<m>", 3)) e->mod = nn + 1;
+        else if (strncmp(s, "<n>", 3)) return 1;
+        s += 3;
+      }
+      else
+      {
+        for (v = 0; *s >= '0' && *s <= '9'; ++s)
+          if ((v = v * 10 + *s - '0') >= ANY) return 1;
+        e->v[nn] = v;
+      }
+      ++nn;
+      c = '0';
+    }
+    else ++s;
+    n = edge(n, c);
+    if (!n) return 1;
+  }
+  if (b == '0') return 1;
+  node_a[n].flags |= NF_LEAF;
+  e->leaf = n;
+  return 0;
+}
+
+/* load *********************************************************************/
+static int load (char const * path)
+{
+  FILE * f;
+  char line[0x200];
+  unsigned int ln = 0;
+
+  f = fopen(path, "r");
+  if (!f) { perror(path); return 1; }
+  while (fgets(line, sizeof(line), f))
+  {
+    ++ln;
+    if (line[0] == '#' || line[strspn(line, " \t\r\n")] == 0) continue;
+    if (parse_line(line, ln))
+    {
+      fprintf(stderr, "%s:%u: bad line\n", path, ln);
+      fclose(f);
+      return 1;
+    }
+  }
+  fclose(f);
+  return 0;
+}
+
+/* check ********************************************************************/
+/* leaves end sequences so they cannot have edges */
+static int check (char const * path)
+{
+  unsigned int i, b;
+
+  for (i = 0; i < ent_n; ++i)
+  {
+    for (b = 0; b < 0x80 && !node_a[ent_a[i].leaf].next[b]; ++b);
+    if (b < 0x80)
+    {
+      fprintf(stderr, "%s:%u: sequence is the start of others\n",
+              path, ent_a[i].ln);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* classify *****************************************************************/
+/* bytes with the same edges from all nodes share a class */
+static void classify ()
+{
+  unsigned int b, c, n;
+
+  class_n = 2;
+  for (b = 0; b < 0x80; ++b)
+  {
+    if (b >= '0' && b <= '9') { class_a[b] = 1; continue; }
+    for (n = 0; n < node_n && !node_a[n].next[b]; ++n);
+    if (n == node_n) { class_a[b] = 0; continue; }
+    for (c = 0; c < b; ++c)
+    {
+      if (class_a[c] < 2) continue;
+      for (n = 0; n < node_n && node_a[n].next[b] == node_a[n].next[c]; ++n);
+      if (n == node_n) break;
+    }
+    class_a[b] = c < b ? class_a[c] : class_n++;
+  }
+}
+
+/* main *********************************************************************/
+int main (int argc, char const * const * argv)
+{
+  unsigned int i, b, c, n, ofs;
+
+  if (argc != 2)
+  {
+    fprintf(stderr, "usage: %s escseq.txt > esctab.inc\n", argv[0]);
+    return 1;
+  }
+  if (load(argv[1]) || check(argv[1])) return 2;
+  classify();
+
+  printf("/* generated by escgen from escseq.txt; do not edit */\n");
+  printf("#define ESC_CLASSES %u\n#define ESC_DIGIT_CLASS 1\n\n", class_n);
+  printf("static uint8_t const esc_class_a[0x80] =\n{");
+  for (b = 0; b < 0x80; ++b)
+    printf("%s%2u,", b % 16 ? "" : "\n  ", class_a[b]);
+  printf("\n};\n\nstatic uint8_t const esc_next_a[][ESC_CLASSES] =\n{\n");
+  for (n = 0; n < node_n; ++n)
+  {
+    printf("  { // %u", n);
+    for (c = 0; c < class_n; ++c)
+    {
+      for (b = 0; b < 0x80 && class_a[b] != c; ++b);
+      printf("%s%3u,", c % 16 ? "" : "\n   ", b < 0x80 ? node_a[n].next[b] : 0);
+    }
+    printf("\n  },\n");
+  }
+  printf("};\n\nstatic esc_node_t const esc_node_a[] =\n{\n");
+  for (n = ofs = 0; n < node_n; ++n)
+  {
+    for (i = c = 0; i < ent_n; ++i) c += ent_a[i].leaf == n;
+    printf("  { %u, %3u, %3u },\n", node_a[n].flags, ofs, c);
+    ofs += c;
+  }
+  printf("};\n\nstatic esc_ent_t const esc_ent_a[] =\n{\n");
+  for (n = 0; n < node_n; ++n)
+    for (i = 0; i < ent_n; ++i)
+    {
+      if (ent_a[i].leaf != n) continue;
+      printf("  { %s, {", ent_a[i].reply ? "0" : ent_a[i].key);
+      for (c = 0; c < MAX_NUMS; ++c)
+        if (ent_a[i].v[c] == ANY) printf(" ESC_ANY,");
+        else printf(" %u,", ent_a[i].v[c]);
+      printf(" }, %u, %s },\n", ent_a[i].mod,
+             ent_a[i].reply ? ent_a[i].reply : "0");
+    }
+  printf("};\n\n");
+  return 0;
+}
@@ -1,6 +1,6 @@
 #ifndef _WIN32
 
-#define _POSIX_C_SOURCE 199309
+#define _POSIX_C_SOURCE 199506
 
 /* acx1 - Application Console Interface - ver. 1
  *
@@ -25,11 +25,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 #include <pthread.h>
@@ -37,6 +40,8 @@
 #include "acx1.h"
 
 char * escstr (char * out, size_t out_len, void const * buf, size_t len);
+int rect_row_skip (uint8_t const * row, size_t len, size_t n, size_t * ofs_p,
+                   int * attr_p, int * split_p);
 
 //static char const S7C1T[] = "\e F";
 // static char const S8C1T[] = "\e G";
@@ -52,10 +57,14 @@ char const SHOW_CURSOR[] = "\e[?25h";
 char const WRAPAROUND_MODE[] = "\e[?7h";
 char const NO_WRAPAROUND_MODE[] = "\e[?7l";
 char const BACKARROW_SENDS_DEL[] = "\e[?67h";
+char const REQUEST_SYNC_UPDATE_MODE[] = "\e[?2026$p";
+char const BEGIN_SYNC_UPDATE[] = "\e[?2026h";
+char const END_SYNC_UPDATE[] = "\e[?2026l";
+char const BRACKETED_PASTE_MODE[] = "\e[?2004h";
+char const NO_BRACKETED_PASTE_MODE[] = "\e[?2004l";
 
 static pthread_t worker_th;
 static pthread_mutex_t mutex;
-static pthread_cond_t event_cond;
 static pthread_cond_t read_event_done_cond;
 static pthread_cond_t cursor_cond;
 static FILE * log_file = NULL;
@@ -66,11 +75,16 @@ static uint16_t screen_width, screen_height;
 static uint16_t user_row, user_col;
 static uint16_t real_row, real_col;
 static int worker_pipe[2] = { -1, -1};
+static int event_fd = -1; // wakes acx1_read_events() when waiting_for_event
+static int sig_fd = -1; // SIGWINCH as a signalfd
+static int poll_fd = -1; // epoll of tty_fd and sig_fd, without the worker
+static sigset_t orig_sigmask;
+static char threadless = 0; // no worker; input is read by the app's thread
+static char sigmask_set = 0;
 static char writing = 0;
 static char tio_set = 0;
 static char th_created = 0;
 static char mutex_created = 0;
-static char event_cond_created = 0;
 static char cursor_cond_created = 0;
 static char waiting_for_event = 0;
 static char waiting_for_cursor = 0;
@@ -81,11 +95,61 @@ static char sigwinch_set = 0;
 static char finishing = 0;
 static uint8_t cursor_mode = 0;
 
-static uint32_t * queue_a = NULL;
-static uint8_t queue_shift; // log2 size of queue
-static unsigned int queue_len, qx_mask, qx_begin, qx_end;
-static unsigned int worker_error = 0;
-static unsigned int decode_mode = 0;
+/* input keys go through a single-producer (worker) single-consumer
+ * (acx1_read_events) ring without locks; when the ring is full the worker
+ * chains a ring twice as big and the reader frees the old one once it has
+ * emptied it */
+#define QUEUE_INIT_SHIFT 6
+#define QUEUE_MAX_SHIFT 16
+typedef struct qseg_s qseg_t;
+struct qseg_s
+{
+  qseg_t * next; // set by the producer once it stops using this ring
+  unsigned int mask;
+  unsigned int head; // free running pop count; written by the consumer
+  unsigned int tail; // free running push count; written by the producer
+  uint32_t a[1];
+};
+static qseg_t * qprod_seg = NULL;
+static qseg_t * qcons_seg = NULL;
+static unsigned long queue_drops = 0; // keys lost because a ring alloc failed
+static unsigned int worker_error = 0; // why the worker stopped, ACX1_xxx
+static unsigned int decode_mode = 0; // 1 while a cursor position is expected
+static uint32_t u8_state = 0; // utf8 dfa state kept between reads
+static uint32_t u8_cp = 0; // code point bits gathered so far
+static uint8_t in_buf[0x1000]; // tty input
+
+typedef struct cell_s cell_t;
+struct cell_s
+{
+  uint32_t ch; // code point; 0 marks the right half of a wide char
+  acx1_attr_t attr;
+};
+
+static cell_t * back_a = NULL; // frame being composed in retained mode
+static cell_t * front_a = NULL; // last frame sent to the terminal
+static uint32_t * row_hash_a; // 2 * cells_height, allocated after front_a
+static uint16_t cells_height, cells_width;
+static char retained = 0;
+static char front_valid = 0;
+static acx1_attr_t pen_attr = { ACX1_BLACK, ACX1_GRAY, ACX1_NORMAL };
+static uint16_t pen_row, pen_col; // write position in retained mode
+
+static uint8_t * obuf_a = NULL; // output collected while writing
+static size_t obuf_len, obuf_size;
+static acx1_stats_t stats;
+static acx1_attr_t term_attr; // attributes last sent to the terminal
+static char term_attr_valid = 0;
+static uint16_t term_row, term_col; // cursor on the terminal; 0 = unknown
+static uint16_t term_width;
+static unsigned int resize_count = 0; // bumped by the worker on each resize
+static unsigned int term_resize_count = 0;
+static uint32_t term_caps = 0; // ACX1_CAP_xxx
+static char caps_set = 0; // caps given by the app; ignore terminal replies
+static char frame_sync = 0; // current frame is a synchronized update
+
+#define PRESENT_GAP 3 // max unchanged cells rewritten instead of moving cursor
+#define UNKNOWN_CELL 0xFFFFFFFF // front cell whose terminal content is unknown
 
 #define LW(...) (log_level >= 2 && log_file ? \
                  (fprintf(log_file, "[acx1]Warning(%s:%03u:%s): ", \
@@ -123,80 +187,462 @@ ACX1_API void acx1_logging (int level, FILE * lf)
   log_level = level;
 }
 
+/* dec_pairs_a **************************************************************/
+static char const dec_pairs_a[201] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+/* uint_str *****************************************************************/
+/* writes n in decimal without a terminator, two digits at a time from the
+ * end; returns the length */
+static uint_t ACX1_CALL uint_str (uint8_t * buf, uint32_t n)
+{
+  uint_t len, k;
+
+  if (n < 10) { buf[0] = '0' + n; return 1; }
+  if (n < 100) { memcpy(buf, &dec_pairs_a[n * 2], 2); return 2; }
+  len = n < 1000 ? 3 : n < 10000 ? 4 : n < 100000 ? 5 : n < 1000000 ? 6 :
+    n < 10000000 ? 7 : n < 100000000 ? 8 : n < 1000000000 ? 9 : 10;
+  for (k = len; n >= 100; n /= 100)
+  {
+    k -= 2;
+    memcpy(&buf[k], &dec_pairs_a[(n % 100) * 2], 2);
+  }
+  if (n < 10) buf[0] = '0' + n;
+  else memcpy(buf, &dec_pairs_a[n * 2], 2);
+  return len;
+}
+
 /* set_cursor_pos_str ********************************************************/
 static uint_t ACX1_CALL set_cursor_pos_str (uint8_t * buf, 
                                             uint16_t r, uint16_t c)
 {
-  return sprintf((char *) buf, "\e[%u;%uH", r, c);
+  uint_t len = 2;
+
+  buf[0] = 0x1B;
+  buf[1] = '[';
+  if (r != 1 || c != 1) len += uint_str(&buf[len], r);
+  if (c != 1)
+  {
+    buf[len++] = ';';
+    len += uint_str(&buf[len], c);
+  }
+  buf[len++] = 'H';
+  return len;
 }
 
-/* set_attr_str *************************************************************/
-static uint_t ACX1_CALL set_attr_str (uint8_t * buf, int bg, int fg, int mode)
+/* csi_move_str *************************************************************/
+/* relative move by n using the 1-byte control ch when repeating it is no
+ * longer than the CSI sequence with the given final byte */
+static uint_t ACX1_CALL csi_move_str (uint8_t * buf, uint_t n,
+                                      uint8_t ch, uint8_t final)
 {
-  int ia[0x10], in;
-  int o, k;
+  uint_t k;
+
+  if (ch && n <= 3)
+  {
+    for (k = 0; k < n; ++k) buf[k] = ch;
+    return n;
+  }
+  buf[0] = 0x1B;
+  buf[1] = '[';
+  k = n == 1 ? 2 : 2 + uint_str(&buf[2], n);
+  buf[k++] = final;
+  return k;
+}
 
-  o = 0;
-  in = 0;
-  ia[in++] = 0;
-  if (bg < 0) return ACX1_NO_CODE;
-  if (bg < 8) ia[in++] = 40 + bg;
-  else if (bg < 0x10) ia[in++] = 100 - 8 + bg;
-  else { ia[in++] = 38; ia[in++] = 5; ia[in++] = bg; }
+/* cursor_move_str **********************************************************/
+/* builds the cheapest sequence that takes the cursor from where the terminal
+ * has it to (r, c): nothing, CR, BS/CUB, CUF, LF/CUD, CUU, CHA or CUP */
+static uint_t ACX1_CALL cursor_move_str (uint8_t * buf, uint16_t r, uint16_t c)
+{
+  uint8_t tmp[0x40];
+  uint8_t hb[0x20];
+  uint8_t cha[0x20];
+  uint_t len, l, hl, chal;
 
-  if (fg < 0) return ACX1_NO_CODE;
-  if (fg < 8) ia[in++] = 30 + fg;
-  else if (fg < 0x10) ia[in++] = 90 - 8 + fg;
-  else { ia[in++] = 48; ia[in++] = 5; ia[in++] = fg; }
+  len = set_cursor_pos_str(buf, r, c);
+  if (term_row && term_col)
+  {
+    if (r == term_row) l = 0;
+    else if (r > term_row) l = csi_move_str(tmp, r - term_row, '\n', 'B');
+    else l = csi_move_str(tmp, term_row - r, 0, 'A');
 
-  if ((mode & ACX1_BOLD)) ia[in++] = 1;
-  if ((mode & ACX1_UNDERLINE)) ia[in++] = 4;
-  if ((mode & ACX1_INVERSE)) ia[in++] = 7;
+    if (c == term_col) hl = 0;
+    else if (c == 1) { hb[0] = '\r'; hl = 1; }
+    else
+    {
+      hl = c > term_col ? csi_move_str(hb, c - term_col, 0, 'C')
+                        : csi_move_str(hb, term_col - c, '\b', 'D');
+      chal = csi_move_str(cha, c, 0, 'G');
+      if (chal < hl) memcpy(hb, cha, hl = chal);
+    }
+    memcpy(&tmp[l], hb, hl);
+    l += hl;
+    if (l < len) memcpy(buf, tmp, len = l);
+  }
+  term_row = r;
+  term_col = c;
+  return len;
+}
+
+/* term_advance *************************************************************/
+/* accounts for the cursor moving right after printing cw columns; with
+ * auto-wrap off the cursor cannot go past the last column so going beyond
+ * that leaves the position unknown */
+static void term_advance (size_t cw)
+{
+  if (!term_col) return;
+  if (term_col + cw > term_width) term_row = term_col = 0;
+  else term_col += cw;
+}
+
+/* term_sync ****************************************************************/
+/* forgets the cursor position if the terminal was resized; call with the
+ * mutex held */
+static void term_sync ()
+{
+  if (term_resize_count == resize_count) return;
+  term_resize_count = resize_count;
+  term_width = screen_width;
+  term_row = term_col = 0;
+}
+
+/* term_caps_a **************************************************************/
+static struct
+{
+  char const * name;
+  uint32_t caps;
+  char query; // parses DECRQM so it can be asked about modes
+} const term_caps_a[] =
+{
+  { "xterm", ACX1_CAP_BCE | ACX1_CAP_ECH | ACX1_CAP_REP, 1 },
+  { "tmux", ACX1_CAP_BCE | ACX1_CAP_ECH | ACX1_CAP_REP, 1 },
+  { "st", ACX1_CAP_BCE | ACX1_CAP_ECH | ACX1_CAP_REP, 1 },
+  { "kitty", ACX1_CAP_BCE | ACX1_CAP_ECH | ACX1_CAP_REP |
+    ACX1_CAP_256 | ACX1_CAP_RGB, 1 },
+  { "xterm-kitty", ACX1_CAP_BCE | ACX1_CAP_ECH | ACX1_CAP_REP |
+    ACX1_CAP_256 | ACX1_CAP_RGB, 1 },
+  { "alacritty", ACX1_CAP_BCE | ACX1_CAP_ECH | ACX1_CAP_256 | ACX1_CAP_RGB, 1 },
+  { "foot", ACX1_CAP_BCE | ACX1_CAP_ECH | ACX1_CAP_256 | ACX1_CAP_RGB, 1 },
+  { "rxvt", ACX1_CAP_BCE | ACX1_CAP_ECH, 1 },
+  { "linux", ACX1_CAP_BCE | ACX1_CAP_ECH, 0 },
+};
+
+/* detect_term_caps *********************************************************/
+/* looks up the terminal type; "xterm-256color" matches "xterm"; unknown
+ * terminals get no capabilities so everything is written literally;
+ * *query_p tells whether the terminal can be asked about the rest */
+static uint32_t detect_term_caps (char const * term, char const * colorterm,
+                                  char * query_p)
+{
+  size_t k, l;
+  uint32_t caps = 0;
+
+  *query_p = 0;
+  if (!term) return 0;
+  for (k = 0; k < ACX1_ITEM_COUNT(term_caps_a); ++k)
+  {
+    l = strlen(term_caps_a[k].name);
+    if (!strncmp(term, term_caps_a[k].name, l) &&
+        (term[l] == 0 || term[l] == '-'))
+    {
+      *query_p = term_caps_a[k].query;
+      caps = term_caps_a[k].caps;
+      break;
+    }
+  }
+  if (strstr(term, "256color")) caps |= ACX1_CAP_256;
+  if (colorterm && (!strcmp(colorterm, "truecolor") ||
+                    !strcmp(colorterm, "24bit")))
+    caps |= ACX1_CAP_256 | ACX1_CAP_RGB;
+  return caps;
+}
+
+/* attr_eq ******************************************************************/
+static int attr_eq (acx1_attr_t const * a, acx1_attr_t const * b)
+{
+  return a->bg == b->bg && a->fg == b->fg && a->mode == b->mode;
+}
+
+/* sgr_color ****************************************************************/
+static int * ACX1_CALL sgr_color (int * ia, int base, int bright_base,
+                                  uint32_t c)
+{
+  if ((c & ACX1_RGB))
+  {
+    if ((term_caps & ACX1_CAP_RGB))
+    {
+      *ia++ = base + 8;
+      *ia++ = 2;
+      *ia++ = (c >> 16) & 0xFF;
+      *ia++ = (c >> 8) & 0xFF;
+      *ia++ = c & 0xFF;
+      return ia;
+    }
+    c = acx1_rgb_to_index(c, (term_caps & ACX1_CAP_256) ? 256 : 16);
+  }
+  if (c < 8) *ia++ = base + c;
+  else if (c < 0x10) *ia++ = bright_base - 8 + c;
+  else { *ia++ = base + 8; *ia++ = 5; *ia++ = c & 0xFF; }
+  return ia;
+}
+
+/* sgr_str ******************************************************************/
+static uint_t ACX1_CALL sgr_str (uint8_t * buf, int const * ia, int in)
+{
+  int o, k;
 
   buf[0] = 0x1B;
   buf[1] = '[';
   o = 2;
-  for (k = 0; k < in; ++k, o += strlen((char *) &buf[o]))
+  for (k = 0; k < in; ++k)
   {
-    sprintf((char *) &buf[o], "%u;", ia[k]);
+    o += uint_str(&buf[o], ia[k]);
+    buf[o++] = ';';
   }
   buf[o - 1] = 'm';
   return o;
 }
 
+/* set_attr_str *************************************************************/
+static uint_t ACX1_CALL set_attr_str (uint8_t * buf, int bg, int fg, int mode)
+{
+  int ia[0x10];
+  int * p = ia;
+
+  *p++ = 0;
+  p = sgr_color(p, 40, 100, bg);
+  p = sgr_color(p, 30, 90, fg);
+  if ((mode & ACX1_BOLD)) *p++ = 1;
+  if ((mode & ACX1_UNDERLINE)) *p++ = 4;
+  if ((mode & ACX1_INVERSE)) *p++ = 7;
+  return sgr_str(buf, ia, p - ia);
+}
+
+/* attr_update_str **********************************************************/
+/* builds the shortest SGR sequence that switches the terminal from the
+ * attributes it currently has to the given ones: either the changes alone
+ * or a full reset; returns 0 when the terminal already has them */
+static uint_t ACX1_CALL attr_update_str (uint8_t * buf, acx1_attr_t const * a)
+{
+  uint8_t tmp[0x40];
+  int ia[0x10];
+  int * p = ia;
+  uint32_t on, off;
+  uint_t len, dlen;
+
+  if (term_attr_valid && attr_eq(a, &term_attr)) return 0;
+  len = set_attr_str(buf, a->bg, a->fg, a->mode);
+  if (term_attr_valid)
+  {
+    off = term_attr.mode & ~a->mode;
+    on = a->mode & ~term_attr.mode;
+    if ((off & ACX1_BOLD)) *p++ = 22;
+    if ((off & ACX1_UNDERLINE)) *p++ = 24;
+    if ((off & ACX1_INVERSE)) *p++ = 27;
+    if ((on & ACX1_BOLD)) *p++ = 1;
+    if ((on & ACX1_UNDERLINE)) *p++ = 4;
+    if ((on & ACX1_INVERSE)) *p++ = 7;
+    if (a->bg != term_attr.bg) p = sgr_color(p, 40, 100, a->bg);
+    if (a->fg != term_attr.fg) p = sgr_color(p, 30, 90, a->fg);
+    dlen = sgr_str(tmp, ia, p - ia);
+    if (dlen < len) memcpy(buf, tmp, len = dlen);
+  }
+  term_attr = *a;
+  term_attr_valid = 1;
+  return len;
+}
+
+/* can_erase ****************************************************************/
+/* whether erase sequences give the same result as writing spaces with the
+ * attributes the terminal has now */
+static int can_erase (acx1_attr_t const * a)
+{
+  return (term_caps & ACX1_CAP_BCE) &&
+    !(a->mode & (ACX1_UNDERLINE | ACX1_INVERSE));
+}
+
+/* erase_str ****************************************************************/
+/* builds EL or ECH to blank count cells from the cursor, followed by the move
+ * that writing the spaces would have made; returns 0 when the terminal cannot
+ * erase with the current attributes or when the spaces are not longer */
+static uint_t ACX1_CALL erase_str (uint8_t * buf, uint_t count)
+{
+  uint16_t r, c;
+  uint_t len;
+
+  if (!term_col || !term_attr_valid || !can_erase(&term_attr)) return 0;
+  r = term_row;
+  c = term_col;
+  if (c + count > term_width)
+  {
+    memcpy(buf, "\e[K", 3);
+    len = 3;
+    len += cursor_move_str(&buf[len], r, term_width);
+  }
+  else if ((term_caps & ACX1_CAP_ECH))
+  {
+    len = csi_move_str(buf, count, 0, 'X');
+    len += cursor_move_str(&buf[len], r, c + count);
+  }
+  else return 0;
+  if (len < count) return len;
+  term_row = r;
+  term_col = c;
+  return 0;
+}
+
+/* scroll_str ***************************************************************/
+/* builds the sequence that moves rows top..bottom up by n (down if n < 0);
+ * DL/IL at the top row does it and DECSTBM limits the region when it does
+ * not end on the last row of the screen */
+static uint_t ACX1_CALL scroll_str (uint8_t * buf, uint16_t top,
+                                    uint16_t bottom, uint16_t height, int n)
+{
+  uint_t len = 0;
+
+  if (bottom < height)
+  {
+    buf[0] = 0x1B;
+    buf[1] = '[';
+    len = 2 + uint_str(&buf[2], top);
+    buf[len++] = ';';
+    len += uint_str(&buf[len], bottom);
+    buf[len++] = 'r';
+    term_row = term_col = 1; // DECSTBM homes the cursor
+  }
+  len += cursor_move_str(&buf[len], top, 1);
+  len += n > 0 ? csi_move_str(&buf[len], n, 0, 'M')
+               : csi_move_str(&buf[len], -n, 0, 'L');
+  if (bottom < height)
+  {
+    memcpy(&buf[len], "\e[r", 3);
+    len += 3;
+    term_row = term_col = 1;
+  }
+  return len;
+}
+
+/* qseg_alloc ***************************************************************/
+static qseg_t * qseg_alloc (unsigned int shift)
+{
+  qseg_t * s;
+
+  s = malloc(sizeof(qseg_t) + (sizeof(uint32_t) << shift) - sizeof(uint32_t));
+  if (!s) return NULL;
+  s->next = NULL;
+  s->mask = (1 << shift) - 1;
+  s->head = s->tail = 0;
+  return s;
+}
+
 /* qpush1 *******************************************************************/
+/* called only from the worker */
 static unsigned int qpush1 (uint32_t v)
 {
-  unsigned int rc;
-  // pthread_mutex_lock(mutex);
-  if (queue_len == qx_mask)
+  qseg_t * s = qprod_seg;
+  qseg_t * ns;
+  unsigned int t, shift;
+
+  t = s->tail;
+  if (t - __atomic_load_n(&s->head, __ATOMIC_ACQUIRE) > s->mask)
   {
-    rc = ACX1_NO_CODE;
-    goto l_exit;
+    for (shift = 0; (s->mask >> shift) != 0; ++shift);
+    if (shift < QUEUE_MAX_SHIFT) ++shift;
+    ns = qseg_alloc(shift);
+    if (!ns)
+    {
+      __atomic_store_n(&queue_drops, queue_drops + 1, __ATOMIC_RELAXED);
+      LE("no memory to grow the input queue; dropped key 0x%X\n", v);
+      return ACX1_NO_MEM;
+    }
+    LI("growing input queue to %u entries\n", ns->mask + 1);
+    __atomic_store_n(&s->next, ns, __ATOMIC_RELEASE);
+    qprod_seg = s = ns;
+    t = 0;
+  }
+  s->a[t & s->mask] = v;
+  __atomic_store_n(&s->tail, t + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* qpush_text ***************************************************************/
+/* queues n ascii bytes as keys, publishing each ring's share with one store;
+ * called only from the worker */
+static void qpush_text (uint8_t const * p, size_t n)
+{
+  qseg_t * s;
+  unsigned int t, room;
+
+  while (n)
+  {
+    s = qprod_seg;
+    t = s->tail;
+    room = s->mask + 1 - (t - __atomic_load_n(&s->head, __ATOMIC_ACQUIRE));
+    if (!room)
+    {
+      // let qpush1 grow the queue
+      qpush1(*p++);
+      --n;
+      continue;
+    }
+    if (room > n) room = n;
+    n -= room;
+    for (; room; --room) s->a[t++ & s->mask] = *p++;
+    __atomic_store_n(&s->tail, t, __ATOMIC_RELEASE);
   }
-  queue_a[qx_end] = v;
-  qx_end = (qx_end + 1) & qx_mask;
-  queue_len += 1;
-  rc = 0;
-l_exit:
-  // pthread_mutex_unlock(mutex);
-  return rc;
 }
 
 /* qpop1 ********************************************************************/
-static unsigned int qpop1 ()
+/* called only from the thread reading events; returns 0 if empty */
+static int qpop1 (uint32_t * v)
 {
-  unsigned int v;
-  // pthread_mutex_lock(mutex);
-  if (!queue_len) v = 0;
-  else
+  qseg_t * s;
+  qseg_t * ns;
+  unsigned int h;
+
+  for (;;)
   {
-    v = queue_a[qx_begin];
-    qx_begin = (qx_begin + 1) & qx_mask;
-    queue_len -= 1;
+    s = qcons_seg;
+    h = s->head;
+    if (h != __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE))
+    {
+      *v = s->a[h & s->mask];
+      __atomic_store_n(&s->head, h + 1, __ATOMIC_RELEASE);
+      return 1;
+    }
+    ns = __atomic_load_n(&s->next, __ATOMIC_ACQUIRE);
+    if (!ns) return 0;
+    // the producer may have pushed here after the tail was read and then
+    // moved on; next is stored after the last push so the tail read now is
+    // final
+    if (h != __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE)) continue;
+    qcons_seg = ns;
+    free(s);
   }
-  // pthread_mutex_unlock(mutex);
-  return v;
+}
+
+/* wake_reader **************************************************************/
+/* call after publishing a key or setting a flag checked by
+ * acx1_read_events(); pairs with the fence there so either the reader sees
+ * the new state or this sees it waiting */
+static void wake_reader ()
+{
+  uint64_t one = 1;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&waiting_for_event, __ATOMIC_RELAXED)) return;
+  if (write(event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    LW("failed waking reader (error %d = %s)\n", errno, strerror(errno));
 }
 
 /* tty_write ****************************************************************/
@@ -205,7 +651,7 @@ static int tty_write (void const * data, size_t len)
   ssize_t wlen;
   uint8_t const * p;
   int e;
-  fd_set fds;
+  struct pollfd pfd;
 
   if (log_level > 3)
   {
@@ -218,25 +664,480 @@ static int tty_write (void const * data, size_t len)
   for (p = data; len; )
   {
     wlen = write(tty_fd, p, len);
+    stats.write_calls += 1;
     if (wlen < 0)
     {
       e = errno;
       if (e == EINTR) continue;
       LE("write error %d = %s\n", e, strerror(e));
-      FD_ZERO(&fds);
-      FD_SET(tty_fd, &fds);
-      e = select(tty_fd + 1, NULL, &fds, NULL, NULL);
+      // only a full output queue is waited out; the tty may be gone
+      if (e != EAGAIN && e != EWOULDBLOCK) return -1;
+      pfd.fd = tty_fd;
+      pfd.events = POLLOUT;
       LI("waiting for write to be available for tty_fd %d\n", tty_fd);
+      poll(&pfd, 1, -1);
       wlen = 0;
     }
     p += wlen;
     len -= wlen;
+    stats.write_bytes += wlen;
   }
   return len ? -1 : 0;
 }
 
 #define tty_write_const(_m) (tty_write(_m, sizeof(_m) - 1))
 
+/* obuf_reserve *************************************************************/
+static unsigned int obuf_reserve (size_t len)
+{
+  size_t n;
+  uint8_t * a;
+
+  if (obuf_size - obuf_len >= len) return 0;
+  for (n = obuf_size ? obuf_size : 0x1000; n - obuf_len < len; n <<= 1);
+  a = realloc(obuf_a, n);
+  if (!a) return ACX1_NO_MEM;
+  obuf_a = a;
+  obuf_size = n;
+  return 0;
+}
+
+/* out_flush ****************************************************************/
+static int out_flush ()
+{
+  size_t len;
+
+  len = obuf_len;
+  obuf_len = 0;
+  return len ? tty_write(obuf_a, len) : 0;
+}
+
+/* out_write ****************************************************************/
+static int out_write (void const * data, size_t len)
+{
+  if (!writing) return tty_write(data, len);
+  if (obuf_reserve(len))
+  {
+    // no memory to grow the buffer; send things as they come
+    LW("cannot grow output buffer to 0x%lX bytes\n", (long) (obuf_len + len));
+    if (out_flush()) return -1;
+    return tty_write(data, len);
+  }
+  memcpy(&obuf_a[obuf_len], data, len);
+  obuf_len += len;
+  return 0;
+}
+
+#define out_write_const(_m) (out_write(_m, sizeof(_m) - 1))
+
+/* cells_sync_size **********************************************************/
+static unsigned int cells_sync_size ()
+{
+  uint16_t h, w;
+  uint_t r, n;
+  size_t k;
+  cell_t * nb;
+  cell_t * nf;
+
+  pthread_mutex_lock(&mutex);
+  h = screen_height;
+  w = screen_width;
+  pthread_mutex_unlock(&mutex);
+  if (back_a && h == cells_height && w == cells_width) return 0;
+
+  nb = malloc(sizeof(cell_t) * ((size_t) h * w + 1));
+  nf = malloc(sizeof(cell_t) * ((size_t) h * w + 1) +
+              sizeof(uint32_t) * 2 * h);
+  if (!nb || !nf)
+  {
+    free(nb);
+    free(nf);
+    return ACX1_NO_MEM;
+  }
+  for (k = 0; k < (size_t) h * w; ++k)
+  {
+    nb[k].ch = ' ';
+    nb[k].attr = pen_attr;
+  }
+  if (back_a)
+  {
+    // keep what was drawn so far in the area common to both sizes
+    n = w < cells_width ? w : cells_width;
+    for (r = 0; r < h && r < cells_height && n; ++r)
+    {
+      memcpy(&nb[r * w], &back_a[r * cells_width], n * sizeof(cell_t));
+      if (n < cells_width && !back_a[r * cells_width + n].ch)
+        nb[r * w + n - 1].ch = ' '; // wide char cut by the right edge
+    }
+  }
+  free(back_a);
+  free(front_a);
+  back_a = nb;
+  front_a = nf;
+  row_hash_a = (uint32_t *) &nf[(size_t) h * w + 1];
+  cells_height = h;
+  cells_width = w;
+  front_valid = 0;
+  return 0;
+}
+
+/* cells_put ****************************************************************/
+static void cells_put (uint32_t cp, int cw)
+{
+  cell_t * row;
+  uint_t c;
+
+  c = pen_col - 1;
+  if (pen_row >= 1 && pen_row <= cells_height && c < cells_width)
+  {
+    row = &back_a[(pen_row - 1) * cells_width];
+    if (cw == 2 && c + 1 == cells_width) { cp = ' '; cw = 1; }
+    if (!row[c].ch) row[c - 1].ch = ' '; // overwriting right half of wide char
+    if (c + cw < cells_width && !row[c + cw].ch) row[c + cw].ch = ' ';
+    row[c].ch = cp;
+    row[c].attr = pen_attr;
+    if (cw == 2)
+    {
+      row[c + 1].ch = 0;
+      row[c + 1].attr = pen_attr;
+    }
+  }
+  if (pen_col <= 0xFFFF - cw) pen_col += cw;
+}
+
+/* cells_write **************************************************************/
+static unsigned int cells_write (void const * data, size_t len)
+{
+  uint8_t const * d = data;
+  uint8_t const * e = d + len;
+  uint32_t cp;
+  int l, cw;
+
+  for (; d < e; d += l)
+  {
+    l = acx1_utf8_char_decode_strict(d, e - d, &cp);
+    if (l < 0) return ACX1_BAD_DATA;
+    cw = acx1_term_char_width(cp);
+    if (cw < 0) return ACX1_BAD_DATA;
+    if (cw) cells_put(cp, cw);
+  }
+  return 0;
+}
+
+/* cells_fill ***************************************************************/
+static unsigned int cells_fill (uint32_t ch, uint16_t count)
+{
+  int cw;
+
+  cw = ch < 0x110000 ? acx1_term_char_width(ch) : -1;
+  if (cw <= 0) return ACX1_NO_CODE;
+  for (; count; --count) cells_put(ch, cw);
+  return 0;
+}
+
+/* cells_clear_rect *********************************************************/
+static void cells_clear_rect (uint16_t r, uint16_t c, uint16_t h, uint16_t w)
+{
+  cell_t * row;
+  uint_t i, j;
+
+  if (!r || !c || r > cells_height || c > cells_width) return;
+  if (h > cells_height - r + 1) h = cells_height - r + 1;
+  if (w > cells_width - c + 1) w = cells_width - c + 1;
+  for (i = 0; i < h; ++i)
+  {
+    row = &back_a[(r - 1 + i) * cells_width + c - 1];
+    if (!w) break;
+    if (!row[0].ch) row[-1].ch = ' '; // wide char cut by the left edge
+    if (c - 1 + w < cells_width && !row[w].ch) row[w].ch = ' ';
+    for (j = 0; j < w; ++j)
+    {
+      row[j].ch = ' ';
+      row[j].attr = pen_attr;
+    }
+  }
+}
+
+/* cells_rect ***************************************************************/
+static unsigned int cells_rect
+(
+  acx1_row_t const * rows,
+  uint16_t start_row,
+  uint16_t start_col,
+  uint16_t row_num,
+  uint16_t col_num,
+  uint32_t col_ofs,
+  acx1_attr_t * attrs
+)
+{
+  unsigned int rc = 0;
+  uint_t i, j;
+  size_t o, len;
+  int l, cw, a, split;
+  uint32_t cp;
+  uint8_t const * row;
+  uint16_t saved_row, saved_col;
+  acx1_attr_t saved_attr;
+
+  if (start_row > cells_height || start_col > cells_width) return 0;
+  if (row_num > cells_height - start_row + 1) row_num = cells_height - start_row + 1;
+  if (col_num > cells_width - start_col + 1) col_num = cells_width - start_col + 1;
+
+  saved_row = pen_row;
+  saved_col = pen_col;
+  saved_attr = pen_attr;
+  for (i = 0; i < row_num; ++i)
+  {
+    row = rows[i].data;
+    len = rows[i].len;
+    pen_row = start_row + i;
+    pen_col = start_col;
+    a = 0;
+    o = 0;
+    split = 0;
+    if (col_ofs && rect_row_skip(row, len, col_ofs, &o, &a, &split))
+    { rc = ACX1_BAD_DATA; goto l_exit; }
+    pen_attr = attrs[a];
+    j = 0;
+    if (split && col_num) { cells_put(' ', 1); j = 1; }
+    for (; o < len && j < col_num; o += l)
+    {
+      if (row[o] == '\a')
+      {
+        if (len - o < 2) break;
+        pen_attr = attrs[row[o + 1]];
+        l = 2;
+        continue;
+      }
+      l = acx1_utf8_char_decode_strict(row + o, len - o, &cp);
+      if (l < 0) { rc = ACX1_BAD_DATA; goto l_exit; }
+      cw = acx1_term_char_width(cp);
+      if (cw < 0) { rc = ACX1_BAD_DATA; goto l_exit; }
+      if (!cw) continue;
+      if (j + cw > col_num) break; // wide char does not fit in last column
+      cells_put(cp, cw);
+      j += cw;
+    }
+    for (; j < col_num; ++j) cells_put(' ', 1);
+  }
+l_exit:
+  pen_row = saved_row;
+  pen_col = saved_col;
+  pen_attr = saved_attr;
+  return rc;
+}
+
+/* cells_shift **************************************************************/
+/* moves rows top..bottom (0-based) of the grid up by n (down if n < 0) and
+ * sets the cells of the rows left behind to fill */
+static void cells_shift (cell_t * a, uint_t top, uint_t bottom, int n,
+                         cell_t const * fill)
+{
+  uint_t w = cells_width;
+  uint_t m = n > 0 ? n : -n;
+  uint_t k, e;
+
+  if (m > bottom - top + 1) m = bottom - top + 1;
+  if (n > 0)
+  {
+    memmove(&a[top * w], &a[(top + m) * w], sizeof(cell_t) * w * (bottom + 1 - top - m));
+    k = (bottom + 1 - m) * w;
+  }
+  else
+  {
+    memmove(&a[(top + m) * w], &a[top * w], sizeof(cell_t) * w * (bottom + 1 - top - m));
+    k = top * w;
+  }
+  for (e = k + m * w; k < e; ++k) a[k] = *fill;
+}
+
+/* cells_row_hash ***********************************************************/
+static uint32_t cells_row_hash (cell_t const * row)
+{
+  uint32_t h = 2166136261u;
+  uint_t k;
+
+  for (k = 0; k < cells_width; ++k)
+  {
+    h = (h ^ row[k].ch) * 16777619u;
+    h = (h ^ row[k].attr.bg) * 16777619u;
+    h = (h ^ row[k].attr.fg) * 16777619u;
+    h = (h ^ row[k].attr.mode) * 16777619u;
+  }
+  return h;
+}
+
+/* cells_scroll *************************************************************/
+/* looks for the vertical shift of the presented rows that leaves the most
+ * rows already in place and scrolls that region on the terminal if that
+ * saves repainting more rows than it exposes */
+static void cells_scroll ()
+{
+  uint32_t * hb = row_hash_a;
+  uint32_t * hf = row_hash_a + cells_height;
+  uint_t h = cells_height;
+  uint_t w = cells_width;
+  uint_t r, a, b, top, bottom;
+  int i, n, gain, best_n, best_gain;
+  uint_t run_a, run_len, run_fix, best_a, best_b;
+  cell_t unknown;
+
+  for (r = 0; r < h; ++r)
+  {
+    hb[r] = cells_row_hash(&back_a[r * w]);
+    hf[r] = cells_row_hash(&front_a[r * w]);
+  }
+
+  best_n = best_gain = 0;
+  best_a = best_b = 0;
+  for (n = 1 - (int) h; n < (int) h; ++n)
+  {
+    if (!n) continue;
+    // runs of rows i in back equal to rows i + n in front
+    run_a = run_len = run_fix = 0;
+    for (i = n < 0 ? -n : 0; ; ++i)
+    {
+      if (i < (int) h && i + n < (int) h && hb[i] == hf[i + n])
+      {
+        if (!run_len) run_a = i;
+        run_len += 1;
+        run_fix += hb[i] != hf[i];
+        continue;
+      }
+      if (run_len)
+      {
+        // rows fixed by the shift minus rows exposed by it
+        gain = (int) run_fix - (n < 0 ? -n : n);
+        if (gain > best_gain)
+        {
+          best_gain = gain;
+          best_n = n;
+          best_a = run_a;
+          best_b = run_a + run_len - 1;
+        }
+        run_len = run_fix = 0;
+      }
+      if (i >= (int) h || i + n >= (int) h) break;
+    }
+  }
+  if (!best_gain) return;
+
+  // hashes can collide: keep only the rows that really match
+  for (b = best_a; b <= best_b &&
+       !memcmp(&back_a[b * w], &front_a[(b + best_n) * w], sizeof(cell_t) * w);
+       ++b);
+  if (b == best_a) return;
+  a = best_a;
+  b -= 1;
+
+  if (best_n > 0) { top = a; bottom = b + best_n; }
+  else { top = a + best_n; bottom = b; }
+  if (obuf_reserve(0x40)) return;
+  obuf_len += scroll_str(&obuf_a[obuf_len], top + 1, bottom + 1, h, best_n);
+  unknown.ch = UNKNOWN_CELL;
+  memset(&unknown.attr, 0, sizeof(unknown.attr));
+  cells_shift(front_a, top, bottom, best_n, &unknown);
+}
+
+/* cells_blank **************************************************************/
+/* whether cell p is a space that an erase done with the attributes of cell a
+ * would produce */
+static int cells_blank (cell_t const * p, cell_t const * a)
+{
+  return p->ch == ' ' && attr_eq(&p->attr, &a->attr) && can_erase(&a->attr);
+}
+
+/* cells_present ************************************************************/
+static unsigned int cells_present ()
+{
+  cell_t * b;
+  cell_t * f;
+  uint_t r, c, k, g, w, cw, tail;
+  size_t n, screen_tail;
+
+  if (front_valid) cells_scroll();
+  w = cells_width;
+  n = (size_t) cells_height * w;
+  screen_tail = n;
+  while (screen_tail && cells_blank(&back_a[screen_tail - 1], &back_a[n - 1]))
+    --screen_tail;
+  for (r = 0; r < cells_height; ++r)
+  {
+    b = &back_a[r * w];
+    f = &front_a[r * w];
+    for (tail = w; tail && cells_blank(&b[tail - 1], &b[w - 1]); --tail);
+    for (c = 0; c < w; )
+    {
+      if (front_valid && b[c].ch == f[c].ch && attr_eq(&b[c].attr, &f[c].attr))
+      {
+        ++c;
+        continue;
+      }
+      if (!b[c].ch && c) --c; // changed right half: redraw the wide char
+
+      if (obuf_reserve(0x40 * (PRESENT_GAP + 2))) return ACX1_NO_MEM;
+
+      // blank cells up to the end of the screen or row are erased
+      if ((size_t) r * w + c >= screen_tail && n - r * w - c > 8)
+      {
+        obuf_len += cursor_move_str(&obuf_a[obuf_len], r + 1, c + 1);
+        obuf_len += attr_update_str(&obuf_a[obuf_len], &b[c].attr);
+        memcpy(&obuf_a[obuf_len], "\e[J", 3);
+        obuf_len += 3;
+        r = cells_height;
+        break;
+      }
+      if (c >= tail && w - c > 4)
+      {
+        obuf_len += cursor_move_str(&obuf_a[obuf_len], r + 1, c + 1);
+        obuf_len += attr_update_str(&obuf_a[obuf_len], &b[c].attr);
+        memcpy(&obuf_a[obuf_len], "\e[K", 3);
+        obuf_len += 3;
+        break;
+      }
+      if ((term_caps & ACX1_CAP_ECH) && cells_blank(&b[c], &b[c]))
+      {
+        for (k = c + 1; k < w && cells_blank(&b[k], &b[c]); ++k);
+        if (k - c > 10)
+        {
+          obuf_len += cursor_move_str(&obuf_a[obuf_len], r + 1, c + 1);
+          obuf_len += attr_update_str(&obuf_a[obuf_len], &b[c].attr);
+          obuf_len += csi_move_str(&obuf_a[obuf_len], k - c, 0, 'X');
+          c = k;
+          continue;
+        }
+      }
+
+      // a few unchanged ASCII cells between the cursor and c are rewritten
+      // as that is cheaper than moving the cursor over them
+      k = c;
+      if (term_row == r + 1 && term_col && term_col <= c + 1 &&
+          c + 1 - term_col <= PRESENT_GAP)
+      {
+        for (g = term_col - 1; g < c && b[g].ch && b[g].ch < 0x80 &&
+             term_attr_valid && attr_eq(&b[g].attr, &term_attr); ++g);
+        if (g == c) k = term_col - 1;
+      }
+      if (k == c)
+        obuf_len += cursor_move_str(&obuf_a[obuf_len], r + 1, c + 1);
+
+      for (;; k += cw)
+      {
+        obuf_len += attr_update_str(&obuf_a[obuf_len], &b[k].attr);
+        obuf_len += acx1_utf8_char_encode(&obuf_a[obuf_len],
+                                          b[k].ch ? b[k].ch : ' ');
+        cw = (k + 1 < w && !b[k + 1].ch) ? 2 : 1;
+        term_advance(cw);
+        if (k >= c) break;
+      }
+      c = k + cw;
+    }
+  }
+  memcpy(front_a, back_a, sizeof(cell_t) * n);
+  front_valid = 1;
+  return 0;
+}
+
 /* winch_signal *************************************************************/
 static void winch_signal (int sig, siginfo_t * si, void * unused)
 {
@@ -274,40 +1175,6 @@ static void winch_signal (int sig, siginfo_t * si, void * unused)
   }
 }
 
-/* parse_ints ***************************************************************/
-static int parse_ints (uint8_t * data, size_t len, uint32_t * out,
-                       unsigned int out_max_len, unsigned int * out_len)
-{
-  uint8_t b;
-  int g;
-  size_t i;
-
-  *out_len = 0;
-  for (i = 0, g = 1; i < len; ++i)
-  {
-    b = data[i];
-    if (b >= '0' && b <= '9')
-    {
-      if (g)
-      {
-        if (*out_len == out_max_len) return i;
-        *out_len += 1;
-        *out = 0;
-        g = 0;
-      }
-
-      *out = *out * 10 + b - '0';
-    }
-    else if (b == ';')
-    {
-      out++;
-      g = 1;
-    }
-    else break;
-  }
-  return i;
-}
-
 /* decode_modifiers_code ****************************************************/
 static int32_t decode_modifiers_code (int c)
 {
@@ -325,338 +1192,514 @@ static int32_t decode_modifiers_code (int c)
   return -1;
 }
 
-#define DI_KEY 0
-#define DI_MORE 1 // need more data
-#define DI_BAD 2
-#define DI_ESC 3
+/* utf8 dfa from Bjoern Hoehrmann's "Flexible and Economical UTF-8 Decoder":
+ * the first 256 entries map bytes to classes, the rest map a state plus a
+ * class to the next state; states are multiples of 12 */
+#define U8_ACCEPT 0
+#define U8_REJECT 12
+static uint8_t const u8_dfa_a[] =
+{
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+  7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+  8,8,2,2,2,2,2,2,2,2,2,2,2,2,2,2, 2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,
+  10,3,3,3,3,3,3,3,3,3,3,3,3,4,3,3, 11,6,6,6,5,8,8,8,8,8,8,8,8,8,8,8,
+
+  0,12,24,36,60,96,84,12,12,12,48,72, 12,12,12,12,12,12,12,12,12,12,12,12,
+  12, 0,12,12,12,12,12, 0,12, 0,12,12, 12,24,12,12,12,12,12,24,12,24,12,12,
+  12,12,12,12,12,12,12,24,12,12,12,12, 12,24,12,12,12,12,12,12,12,24,12,12,
+  12,12,12,12,12,12,12,36,12,36,12,12, 12,36,12,12,12,12,12,36,12,36,12,12,
+  12,36,12,12,12,12,12,12,12,12,12,12,
+};
+
+/* u8_step ******************************************************************/
+static uint32_t u8_step (uint32_t * state_p, uint32_t * cp_p, uint8_t b)
+{
+  uint32_t t = u8_dfa_a[b];
+  *cp_p = *state_p != U8_ACCEPT ? (b & 0x3Fu) | (*cp_p << 6)
+                                : (0xFFu >> t) & b;
+  return *state_p = u8_dfa_a[256 + *state_p + t];
+}
 
 #define REPORT_CURSOR_POSITION_REPLY 1
+#define REPORT_MODE_REPLY 2
+#define PASTE_START_REPLY 3
+
+/* the escape sequences after ESC are decoded with a trie generated by escgen
+ * from escseq.txt (see escgen.c for the tables); digits in the sequences are
+ * numbers gathered in in_n while walking it */
+#define ESC_NUMS 2 // numbers in a sequence; MAX_NUMS in escgen.c
+#define ESC_ANY 0xFFFF // entry value matching any number
+#define ESC_NUM 1 // node flags: entered by digits
+#define ESC_CSI 2 // after ESC [
+#define ESC_LEAF 4 // end of a sequence
+
+typedef struct esc_node_s esc_node_t;
+struct esc_node_s
+{
+  uint8_t flags;
+  uint16_t ent; // first entry of a leaf in esc_ent_a
+  uint16_t ent_n;
+};
 
-/* decode_input *************************************************************/
-static int decode_input (uint8_t * data, size_t len, uint32_t * out,
-                         size_t * used_len_p, int mode)
+typedef struct esc_ent_s esc_ent_t;
+struct esc_ent_s
 {
-  uint8_t b;
-  int i, m;
-  unsigned int nl;
-  uint32_t n[0x10];
-  //size_t i;
-  if (len == 0) return DI_MORE;
-  b = data[0];
-  if (b >= 0x20 && b <= 0x7E)
-  {
-    *out = b;
-    *used_len_p = 1;
-    return DI_KEY;
-  }
-  if (b >= 0xC0)
+  uint32_t km;
+  uint16_t v[ESC_NUMS]; // number values or ESC_ANY
+  uint8_t mod; // 1 + index of the number with the modifiers; 0 if none
+  uint8_t reply; // xxx_REPLY or 0 for keys
+};
+
+#include "esctab.inc"
+
+/* decoder state, kept between reads so keys can be split anywhere */
+#define IN_GROUND 0 // between keys or in a utf8 char
+#define IN_ESC 1 // in the trie at in_node
+#define IN_SKIP 2 // in an unknown CSI sequence, up to its final byte
+#define IN_PASTE 3 // in bracketed paste, up to ESC [ 201 ~
+static uint8_t in_state = IN_GROUND;
+static uint8_t in_node;
+static uint8_t in_np; // numbers in in_n
+static uint8_t in_len; // bytes after ESC, up to 2
+static uint8_t in_first; // byte after ESC
+static char in_alt = 0; // ESC came before the key
+static char in_pushed = 0; // keys queued since the reader was woken
+static uint16_t in_n[ESC_NUMS];
+static int64_t in_deadline; // when a pending escape is taken as keys
+static unsigned int esc_timeout = 50; // ms to wait for the rest after ESC
+
+/* a bracketed paste reaches the reader as one buffer: the worker gathers the
+ * text in paste_cur, then chains it to the paste list and queues PASTE_KM in
+ * its place among the keys */
+#define PASTE_KM 0xFFFFFFFF
+typedef struct paste_s paste_t;
+struct paste_s
+{
+  paste_t * next;
+  size_t len, size;
+  uint8_t data[1]; // size + 1 bytes, for the terminator
+};
+static paste_t * paste_cur = NULL; // being received
+static paste_t * paste_head = NULL; // received, not read yet; under mutex
+static paste_t * * paste_tail_p = &paste_head;
+static paste_t * paste_given = NULL; // last one returned by read_events
+static uint8_t paste_end_len = 0; // bytes of the end marker matched so far
+static char paste_lost = 0; // part of the current paste did not fit
+
+/* mono_ms ******************************************************************/
+static int64_t mono_ms ()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* in_key *******************************************************************/
+static void in_key (uint32_t km)
+{
+  if (in_alt) { km |= ACX1_ALT; in_alt = 0; }
+  LI("storing km=0x%X\n", km);
+  qpush1(km);
+  in_pushed = 1;
+}
+
+/* paste_add ****************************************************************/
+static void paste_add (uint8_t const * data, size_t len)
+{
+  paste_t * p = paste_cur;
+  size_t size;
+
+  if (!len || paste_lost) return;
+  if (!p || p->len + len > p->size)
   {
-    // decode utf8 char >= 0x80
-    int l;
-    l = acx1_utf8_char_decode_strict(data, len, out);
-    if (l < 0) return DI_BAD;
-    *used_len_p = l;
-    return DI_KEY;
+    size = p ? p->size : 0x1000;
+    while (size < (p ? p->len : 0) + len) size *= 2;
+    p = realloc(paste_cur, sizeof(paste_t) + size);
+    if (!p)
+    {
+      LE("no memory for pasted text; dropping the paste\n");
+      free(paste_cur);
+      paste_cur = NULL;
+      paste_lost = 1;
+      return;
+    }
+    if (!paste_cur) p->len = 0;
+    p->size = size;
+    paste_cur = p;
   }
-  if (b >= 0x80)
+  memcpy(p->data + p->len, data, len);
+  p->len += len;
+}
+
+/* paste_done ***************************************************************/
+/* hands over the paste to the reader; called with the mutex locked */
+static void paste_done ()
+{
+  paste_t * p = paste_cur;
+
+  paste_cur = NULL;
+  if (paste_lost)
   {
-    // term escapes
-    *out = 'E';
-    *used_len_p = 1;
-    return DI_KEY;
+    paste_lost = 0;
+    __atomic_store_n(&queue_drops, queue_drops + 1, __ATOMIC_RELAXED);
+    return;
   }
+  if (!p) return; // nothing pasted
+  LI("storing paste of %u bytes\n", (unsigned int) p->len);
+  p->data[p->len] = 0;
+  if (qpush1(PASTE_KM)) { free(p); return; }
+  p->next = NULL;
+  *paste_tail_p = p;
+  paste_tail_p = &p->next;
+  in_pushed = 1;
+}
+
+/* in_paste *****************************************************************/
+/* takes pasted text up to the end marker (which may be split across reads);
+ * returns where decoding continues */
+static uint8_t const * in_paste (uint8_t const * data, uint8_t const * end)
+{
+  static uint8_t const pe[] = "\e[201~";
+  uint8_t const * p;
 
-  if (b == 0x1B)
+  while (data < end)
   {
-    if (len == 1)
+    if (paste_end_len)
     {
-      *out = ACX1_ESC;
-      *used_len_p = 1;
-      return DI_KEY;
+      if (*data != pe[paste_end_len])
+      {
+        // not the end after all; what matched is text
+        paste_add(pe, paste_end_len);
+        paste_end_len = 0;
+        continue;
+      }
+      ++data;
+      if (++paste_end_len == sizeof(pe) - 1)
+      {
+        paste_end_len = 0;
+        in_state = IN_GROUND;
+        paste_done();
+        break;
+      }
+      continue;
     }
-    b = data[1];
-    if (b == 0x1B)
+    p = memchr(data, 0x1B, end - data);
+    if (!p) p = end;
+    paste_add(data, p - data);
+    data = p;
+    if (p < end) { paste_end_len = 1; ++data; }
+  }
+  return data;
+}
+
+/* in_reply *****************************************************************/
+static void in_reply (unsigned int reply)
+{
+  switch (reply)
+  {
+  case REPORT_CURSOR_POSITION_REPLY:
+    decode_mode = 0;
+    LI("got cursor pos: row %u, col %u\n", in_n[0], in_n[1]);
+    real_row = in_n[0];
+    real_col = in_n[1];
+    if (waiting_for_cursor) pthread_cond_signal(&cursor_cond);
+    if (!writing) { user_row = real_row; user_col = real_col; }
+    break;
+  case REPORT_MODE_REPLY:
+    // comes before the cursor position asked for with it; that one is still
+    // expected
+    LI("got mode %u: %u\n", in_n[0], in_n[1]);
+    // 1 = set, 2 = reset, 3 = permanently set
+    if (in_n[0] == 2026 && in_n[1] >= 1 && in_n[1] <= 3 && !caps_set)
+      term_caps |= ACX1_CAP_SYNC;
+    break;
+  case PASTE_START_REPLY:
+    LI("paste start\n");
+    in_state = IN_PASTE;
+    break;
+  }
+}
+
+/* in_leaf ******************************************************************/
+/* decodes the sequence that ended in leaf in_node; the first entry matching
+ * the numbers wins */
+static void in_leaf ()
+{
+  esc_node_t const * n = &esc_node_a[in_node];
+  esc_ent_t const * e;
+  unsigned int i;
+  int32_t m;
+
+  in_state = IN_GROUND;
+  for (e = &esc_ent_a[n->ent]; e < &esc_ent_a[n->ent + n->ent_n]; ++e)
+  {
+    for (i = 0; i < ESC_NUMS && (e->v[i] == ESC_ANY || e->v[i] == in_n[i]);
+         ++i);
+    if (i < ESC_NUMS) continue;
+    if (e->reply)
     {
-      if (mode == 1) return DI_BAD;
-      i = decode_input(data + 1, len - 1, out, used_len_p, 1);
-      if (i != DI_KEY) return DI_BAD;
-      *out |= ACX1_ALT;
-      *used_len_p += 1;
-      return DI_KEY;
+      // the reply to a position query looks like F3 with modifiers
+      if (e->reply == REPORT_CURSOR_POSITION_REPLY && !(decode_mode & 1))
+        continue;
+      in_alt = 0;
+      in_reply(e->reply);
+      return;
     }
-    data += 2; len -= 2;
-    if (b == '[' && len) // CSI
+    m = e->mod ? decode_modifiers_code(in_n[e->mod - 1]) : 0;
+    if (m < 0) break;
+    in_key(e->km | m);
+    return;
+  }
+  in_alt = 0;
+  LI("ignoring unknown escape sequence ending in node %u\n", in_node);
+}
+
+/* in_decode ****************************************************************/
+static void in_decode (uint8_t const * data, size_t len)
+{
+  uint8_t const * end = data + len;
+  uint8_t const * p;
+  unsigned int b, c, nx;
+  uint32_t v;
+  int fresh;
+
+  while (data < end)
+  {
+    b = *data;
+    switch (in_state)
     {
-      if (data[0] == '[')
+    case IN_GROUND:
+      if (u8_state != U8_ACCEPT || b >= 0x80)
       {
-        /* linux text-mode terminal: */
-        if (len != 2) return DI_BAD;
-        switch (data[1])
+        fresh = u8_state == U8_ACCEPT;
+        switch (u8_step(&u8_state, &u8_cp, b))
         {
-        case 'A': case 'B': case 'C': case 'D': case 'E':
-          *out = ACX1_F1 + data[1] - 'A'; return DI_KEY;
+        case U8_ACCEPT:
+          in_key(u8_cp);
+          break;
+        case U8_REJECT:
+          // bad sequences are skipped but a byte that breaks one starts anew
+          u8_state = U8_ACCEPT;
+          if (!fresh) continue;
         }
-        return DI_BAD;
+        ++data;
+        continue;
       }
-      // if (data[0] == '?')
-      // {
-      //   if (len == 1) return DI_BAD;
-      //   i = parse_ints(data  + 1, len - 1, n,
-      //                  sizeof(n) / sizeof(uint32_t), &nl);
-      //   if ((size_t) i == len) return DI_BAD;
-      // *used_len_p = 3 + i + 1;
-      //   switch (data[i])
-      //   {
-      //   case 'R':
-      //     if (nl != 2) return DI_BAD;
-      //     out[0] = REPORT_CURSOR_POSITION_REPLY;
-      //     out[1] = n[0];
-      //     out[2] = n[1];
-      //     return DI_ESC;
-      //   }
-      //   return DI_BAD;
-      // }
-
-      i = parse_ints(data, len, n, sizeof(n) / sizeof(uint32_t), &nl);
-      if ((size_t) i == len) return DI_BAD;
-      b = data[i];
-      *used_len_p = 2 + i + 1;
-      switch (b)
+      if (b - 0x20 < 0x5F && !in_alt)
       {
-      case '~':
-        m = decode_modifiers_code(nl == 2 ? n[1] : 0);
-        if (m < 0) return DI_BAD;
-        if (!nl || nl > 2) return DI_BAD;
-        switch (n[0])
-        {
-        case  1: *out = m | ACX1_HOME;          return DI_KEY;
-        case  2: *out = m | ACX1_INS;           return DI_KEY;
-        case  3: *out = m | ACX1_DEL;           return DI_KEY;
-        case  4: *out = m | ACX1_END;           return DI_KEY;
-        case  5: *out = m | ACX1_PAGE_UP;       return DI_KEY;
-        case  6: *out = m | ACX1_PAGE_DOWN;     return DI_KEY;
-        case  7: *out = m | ACX1_HOME;          return DI_KEY; // rxvt
-        case  8: *out = m | ACX1_END;           return DI_KEY; // rxvt
-        case 11: *out = m | ACX1_F1;            return DI_KEY; // rxvt
-        case 12: *out = m | ACX1_F2;            return DI_KEY; // rxvt
-        case 13: *out = m | ACX1_F3;            return DI_KEY; // rxvt
-        case 14: *out = m | ACX1_F4;            return DI_KEY; // rxvt
-        case 15: *out = m | ACX1_F5;            return DI_KEY;
-        case 17: *out = m | ACX1_F6;            return DI_KEY;
-        case 18: *out = m | ACX1_F7;            return DI_KEY;
-        case 19: *out = m | ACX1_F8;            return DI_KEY;
-        case 20: *out = m | ACX1_F9;            return DI_KEY;
-        case 21: *out = m | ACX1_F10;           return DI_KEY;
-        case 23: *out = m | ACX1_F11;           return DI_KEY;
-        case 24: *out = m | ACX1_F12;           return DI_KEY;
-        case 25: *out = ACX1_SHIFT | ACX1_F1;   return DI_KEY;
-        case 26: *out = ACX1_SHIFT | ACX1_F2;   return DI_KEY;
-        case 27: *out = ACX1_SHIFT | ACX1_F3;   return DI_KEY;
-        case 28: *out = ACX1_SHIFT | ACX1_F4;   return DI_KEY;
-        case 29: *out = ACX1_SHIFT | ACX1_F5;   return DI_KEY;
-        case 31: *out = ACX1_SHIFT | ACX1_F6;   return DI_KEY;
-        case 32: *out = ACX1_SHIFT | ACX1_F7;   return DI_KEY;
-        case 33: *out = ACX1_SHIFT | ACX1_F8;   return DI_KEY;
-        case 34: *out = ACX1_SHIFT | ACX1_F9;   return DI_KEY;
-        case 35: *out = ACX1_SHIFT | ACX1_F10;  return DI_KEY;
-        case 37: *out = ACX1_SHIFT | ACX1_F11;  return DI_KEY;
-        case 38: *out = ACX1_SHIFT | ACX1_F12;  return DI_KEY;
-        }
-        return DI_BAD;
-      case 'A': m = ACX1_UP;                    goto l_alt_pad;
-      case 'B': m = ACX1_DOWN;                  goto l_alt_pad;
-      case 'C': m = ACX1_RIGHT;                 goto l_alt_pad;
-      case 'D': m = ACX1_LEFT;                  goto l_alt_pad;
-      case 'E': m = ACX1_KP_CENTER;             goto l_alt_pad;
-      case 'F': m = ACX1_END;                   goto l_alt_pad;
-      case 'H': m = ACX1_HOME;
-l_alt_pad:
-        m |= decode_modifiers_code(nl == 2 ? n[1] : 0);
-        if (m < 0) return DI_BAD;
-        *out = m;
-        return DI_KEY;
-      case 'R': // CPR: report cursor position
-        if (mode == 1)
-        {
-          if (nl != 2) return DI_BAD;
-          out[0] = REPORT_CURSOR_POSITION_REPLY;
-          out[1] = n[0];
-          out[2] = n[1];
-          return DI_ESC;
-        }
-       case 'P': case 'Q': case 'S':
-        if (nl != 2) return DI_BAD;
-        m = decode_modifiers_code(nl == 2 ? n[1] : 0);
-        if (m < 0) return DI_BAD;
-        *out = (ACX1_F1 + b - 'P') | m;
-        return DI_KEY;
-      case 'a': *out = ACX1_SHIFT | ACX1_UP;    return DI_KEY; //rxvt
-      case 'b': *out = ACX1_SHIFT | ACX1_DOWN;  return DI_KEY; //rxvt
-      case 'c': *out = ACX1_SHIFT | ACX1_RIGHT; return DI_KEY; //rxvt
-      case 'd': *out = ACX1_SHIFT | ACX1_LEFT;  return DI_KEY; //rxvt
-      case '$':
-        if (nl != 1) return DI_BAD;
-        m = ACX1_SHIFT;
-        switch (n[0])
-        {
-        case 2: *out = m | ACX1_INS;            return DI_KEY; // rxvt
-        case 3: *out = m | ACX1_DEL;            return DI_KEY; // rxvt
-        case 5: *out = m | ACX1_PAGE_UP;        return DI_KEY; // rxvt
-        case 6: *out = m | ACX1_PAGE_DOWN;      return DI_KEY; // rxvt
-        case 7: *out = m | ACX1_HOME;           return DI_KEY; // rxvt
-        case 8: *out = m | ACX1_END;            return DI_KEY; // rxvt
-        }
-        return DI_BAD;
-      case '^':
-        if (nl != 1) return DI_BAD;
-        m = ACX1_CTRL;
-        switch (n[0])
-        {
-        case 2: *out = m | ACX1_INS;            return DI_KEY; // rxvt
-        case 3: *out = m | ACX1_DEL;            return DI_KEY; // rxvt
-        case 5: *out = m | ACX1_PAGE_UP;        return DI_KEY; // rxvt
-        case 6: *out = m | ACX1_PAGE_DOWN;      return DI_KEY; // rxvt
-        case 7: *out = m | ACX1_HOME;           return DI_KEY; // rxvt
-        case 8: *out = m | ACX1_END;            return DI_KEY; // rxvt
-        }
-        return DI_BAD;
-      case '@':
-        if (nl != 1) return DI_BAD;
-        m = ACX1_CTRL | ACX1_SHIFT;
-        switch (n[0])
-        {
-        case 2: *out = m | ACX1_INS;            return DI_KEY; // rxvt
-        case 3: *out = m | ACX1_DEL;            return DI_KEY; // rxvt
-        case 5: *out = m | ACX1_PAGE_UP;        return DI_KEY; // rxvt
-        case 6: *out = m | ACX1_PAGE_DOWN;      return DI_KEY; // rxvt
-        case 7: *out = m | ACX1_HOME;           return DI_KEY; // rxvt
-        case 8: *out = m | ACX1_END;            return DI_KEY; // rxvt
-        }
-        return DI_BAD;
-      case 'Z':
-        *out = ACX1_SHIFT | ACX1_TAB; return DI_KEY;
+        // runs of text, as in pastes, go straight to the queue
+        for (p = data + 1; p < end && (unsigned int) *p - 0x20 < 0x5F; ++p);
+        qpush_text(data, p - data);
+        data = p;
+        in_pushed = 1;
+        continue;
       }
-      return DI_BAD;
-    }
-    if (b == 'O' && len) // SS3
-    {
-      i = parse_ints(data, len, n, sizeof(n) / sizeof(uint32_t), &nl);
-      if ((size_t) i == len) return DI_BAD;
-      *used_len_p = 2 + i + 1;
-      b = data[i];
-      m = decode_modifiers_code(nl == 2 ? n[1] : 0);
-      if (m < 0) return DI_BAD;
+      ++data;
       switch (b)
       {
-      case 'A': *out = m | ACX1_UP;                             return DI_KEY;
-      case 'B': *out = m | ACX1_DOWN;                           return DI_KEY;
-      case 'C': *out = m | ACX1_RIGHT;                          return DI_KEY;
-      case 'D': *out = m | ACX1_LEFT;                           return DI_KEY;
-      case 'E': *out = m | ACX1_KP_CENTER;                      return DI_KEY;
-      case 'F': *out = m | ACX1_END;                            return DI_KEY; // evilvte
-      case 'H': *out = m | ACX1_HOME;                           return DI_KEY; // evilvte
-      case 'M': *out = m | ACX1_KP_ENTER;                       return DI_KEY;
-      case 'j': *out = m | ACX1_KP_MUL;                         return DI_KEY;
-      case 'k': *out = m | ACX1_KP_ADD;                         return DI_KEY;
-      case 'l': *out = m | ACX1_KP_COMMA;                       return DI_KEY;
-      case 'm': *out = m | ACX1_KP_SUB;                         return DI_KEY;
-      case 'o': *out = m | ACX1_KP_DIV;                         return DI_KEY;
-/* TODO: the following are not SHIFTed when in RXVT */
-      case 'n': *out = ACX1_SHIFT | ACX1_KP_DEL;                return DI_KEY;
-      case 'p': *out = ACX1_SHIFT | ACX1_KP_INS;                return DI_KEY;
-      case 'q': *out = ACX1_SHIFT | ACX1_KP_END;                return DI_KEY;
-      case 'r': *out = ACX1_SHIFT | ACX1_KP_DOWN;               return DI_KEY;
-      case 's': *out = ACX1_SHIFT | ACX1_KP_PAGE_DOWN;          return DI_KEY;
-      case 't': *out = ACX1_SHIFT | ACX1_KP_LEFT;               return DI_KEY;
-      case 'u': *out = ACX1_SHIFT | ACX1_KP_CENTER;             return DI_KEY;
-      case 'v': *out = ACX1_SHIFT | ACX1_KP_RIGHT;              return DI_KEY;
-      case 'w': *out = ACX1_SHIFT | ACX1_KP_HOME;               return DI_KEY;
-      case 'x': *out = ACX1_SHIFT | ACX1_KP_UP;                 return DI_KEY;
-      case 'y': *out = ACX1_SHIFT | ACX1_KP_PAGE_UP;            return DI_KEY;
-      case 'P': case 'Q': case 'R': case 'S':
-        *out = ACX1_F1 + b - 'P';
-        i = decode_modifiers_code(nl == 2 ? n[1] : 0);
-        if (i < 0) return DI_BAD;
-        *out |= i;
-        return DI_KEY;
-      case 'a': *out = ACX1_CTRL | ACX1_UP;   return DI_KEY; // rxvt
-      case 'b': *out = ACX1_CTRL | ACX1_DOWN; return DI_KEY; // rxvt
-      case 'c': *out = ACX1_CTRL | ACX1_RIGHT;return DI_KEY; // rxvt
-      case 'd': *out = ACX1_CTRL | ACX1_LEFT; return DI_KEY; // rxvt
+      case 0x00: in_key(ACX1_CTRL | ACX1_SPACE); break;
+      case 0x08: in_key(ACX1_BACKSPACE); break;
+      case 0x09: in_key(ACX1_TAB); break;
+      case 0x0D: in_key(ACX1_ENTER); break;
+      case 0x1B:
+        in_state = IN_ESC;
+        in_node = 0;
+        in_np = in_len = 0;
+        break;
+      case 0x7F: in_key(ACX1_BACKSPACE); break;
+      default:
+        in_key(b < 0x20 ? ACX1_CTRL | 0x40 | b : b);
       }
+      continue;
 
+    case IN_ESC:
+      c = b < 0x80 ? esc_class_a[b] : 0;
+      nx = esc_next_a[in_node][c];
+      if (!nx && !in_node)
+      {
+        // no sequence starts like this: ESC means Alt for the next key; a
+        // third ESC makes the first two Alt+Esc and starts over
+        if (b != 0x1B) { in_state = IN_GROUND; in_alt = 1; continue; }
+        ++data;
+        if (in_alt) in_key(ACX1_ESC);
+        else in_alt = 1;
+        continue;
+      }
+      if (!nx)
+      {
+        // unknown sequence; controls and non-ascii are keys of their own
+        in_state = IN_GROUND;
+        in_alt = 0;
+        LI("ignoring unknown escape sequence at byte 0x%02X\n", b);
+        if (b < 0x20 || b >= 0x7F) continue;
+        ++data;
+        if ((esc_node_a[in_node].flags & ESC_CSI) && b < 0x40)
+          in_state = IN_SKIP;
+        continue;
+      }
+      ++data;
+      if (in_len < 2)
+      {
+        if (!in_len) in_first = b;
+        ++in_len;
+      }
+      if (c == ESC_DIGIT_CLASS)
+      {
+        if (nx != in_node) in_n[in_np++] = 0;
+        v = in_n[in_np - 1] * 10 + b - '0';
+        in_n[in_np - 1] = v < ESC_ANY ? v : ESC_ANY;
+      }
+      in_node = nx;
+      if (esc_node_a[nx].flags & ESC_LEAF) in_leaf();
+      continue;
 
-      return DI_BAD;
+    case IN_SKIP:
+      if (b < 0x20 || b >= 0x7F) { in_state = IN_GROUND; continue; }
+      ++data;
+      if (b >= 0x40) in_state = IN_GROUND;
+      continue;
+
+    case IN_PASTE:
+      data = in_paste(data, end);
+      continue;
     }
+  }
+}
+
+/* in_timeout ***************************************************************/
+/* ms until a pending escape is taken as keys; -1 if there is none; a paste
+ * lasts as long as it takes */
+static int in_timeout ()
+{
+  int64_t t;
+
+  if (in_state == IN_GROUND || in_state == IN_PASTE) return -1;
+  t = in_deadline - mono_ms();
+  return t > 0 ? (int) t : 0;
+}
+
+/* in_flush *****************************************************************/
+/* once its wait is over, ESC alone is the Esc key and ESC with one more byte
+ * is that byte with Alt (ESC [ and ESC O); longer partial sequences are
+ * dropped */
+static void in_flush ()
+{
+  if (in_timeout()) return;
+  pthread_mutex_lock(&mutex);
+  if (in_state == IN_ESC && in_len == 0) in_key(ACX1_ESC);
+  else if (in_state == IN_ESC && in_len == 1) { in_alt = 1; in_key(in_first); }
+  else LW("dropping incomplete escape sequence\n");
+  in_state = IN_GROUND;
+  in_alt = 0;
+  pthread_mutex_unlock(&mutex);
+  if (in_pushed) { in_pushed = 0; wake_reader(); }
+}
+
+/* tty_input ****************************************************************/
+/* reads and decodes what is available on the tty, queueing the keys;
+ * returns 0 or the errno of a failed read, EIO at end of file */
+static int tty_input ()
+{
+  int n, got = 0;
+  char tmp[0x400];
 
-    // decode utf8
-    if (b == 0x7F)
+  while ((n = read(tty_fd, in_buf, sizeof(in_buf))) > 0)
+  {
+    LI("read(tty):%u \"%s\"\n", n, escstr(tmp, sizeof(tmp), in_buf, n));
+    pthread_mutex_lock(&mutex);
+    in_decode(in_buf, n);
+    pthread_mutex_unlock(&mutex);
+    if (in_pushed) { in_pushed = 0; wake_reader(); }
+    got = 1;
+  }
+  // the wait for the rest of an escape starts after the last byte
+  if (got && in_state != IN_GROUND)
+    in_deadline = mono_ms() + __atomic_load_n(&esc_timeout, __ATOMIC_RELAXED);
+
+  if (n < 0)
+  {
+    n = errno;
+    if (n == EINTR)
     {
-      *out = ACX1_ALT | ACX1_BACKSPACE;
-      *used_len_p = 2;
-      return DI_KEY;
+      LI("read(tty) interrupted by signal\n");
+      return 0;
     }
-    *out = ACX1_ALT | b;
-    *used_len_p = 2;
-    return DI_KEY;
+    if (n == EAGAIN)
+    {
+      LI("read(tty) finished input buffer\n");
+      return 0;
+    }
+    LW("read(tty) failed: %d = %s\n", n, strerror(n));
+    return n;
+  }
+  // end of file: the other side hung up
+  LW("read(tty): end of input\n");
+  return EIO;
+}
+
+/* size_check ***************************************************************/
+/* reads the terminal size and flags a resize event if it changed */
+static void size_check ()
+{
+  struct winsize wsz;
+  int n;
+
+  LI("reading terminal size...\n");
+  if (ioctl(tty_fd, TIOCGWINSZ, &wsz))
+  {
+    n = errno;
+    LW("failed to get terminal size with ioctl (error %d = %s)\n",
+       n, strerror(n));
+    return;
   }
 
-  *used_len_p = 1;
-  switch (b)
+  pthread_mutex_lock(&mutex);
+  if (screen_height != wsz.ws_row || screen_width != wsz.ws_col)
   {
-  case 0x00: *out = ACX1_CTRL | ACX1_SPACE; return DI_KEY;
-  case 0x08: *out = ACX1_BACKSPACE; return DI_KEY;
-  case 0x09: *out = ACX1_TAB; return DI_KEY;
-  case 0x0D: *out = ACX1_ENTER; return DI_KEY;
-  // case 0x1B: //*out = ACX1_ESC; return DI_KEY;
-  //   *out = 'e';
-  //   *used_len_p = 1;
-  //   return DI_KEY;
-  case 0x7F:
-    *out = ACX1_BACKSPACE;
-    return DI_KEY;
-  default:
-    *out = ACX1_CTRL | 0x40 | b;
-    return DI_KEY;
+    screen_height = wsz.ws_row;
+    screen_width = wsz.ws_col;
+    __atomic_store_n(&screen_resized, 1, __ATOMIC_RELAXED);
+    resize_count += 1;
   }
+  pthread_mutex_unlock(&mutex);
+  wake_reader();
 }
 
 /* worker_main *************************************************************/
 static void * worker_main (void * arg)
 {
-  int sr, n, di, mode, ofs;
-  fd_set rfds;
-  struct timeval tv;
+  struct pollfd pfd_a[3];
+  struct signalfd_siginfo si;
+  unsigned int err = 0;
+  int n;
   char cmd;
-  uint8_t buf[0x100];
-  char tmp[0x400];
-  uint32_t dec[0x10];
-  size_t ilen;
 
   LI("worker: enter\n");
+  pfd_a[0].fd = worker_pipe[0];
+  pfd_a[1].fd = tty_fd;
+  pfd_a[2].fd = sig_fd;
+  pfd_a[0].events = pfd_a[1].events = pfd_a[2].events = POLLIN;
   for (;;)
   {
-    FD_ZERO(&rfds);
-    FD_SET(worker_pipe[0], &rfds);
-    FD_SET(tty_fd, &rfds);
-
-    n = worker_pipe[0];
-    if (n < tty_fd) n = tty_fd;
-
-    tv.tv_sec = 5;
-    tv.tv_usec = 0;
-    LI("worker: select()\n");
-    sr = select(n + 1, &rfds, NULL, NULL, &tv);
-    if (sr < 0)
+    // an idle session sleeps until input, a resize or finish; the only
+    // timeout is the wait for the rest of an escape sequence
+    LI("worker: poll()\n");
+    if (poll(pfd_a, 3, in_timeout()) < 0)
     {
       if (errno == EINTR) continue;
       n = errno;
-      LE("worker: select() failed: %d = %s\n", n, strerror(n));
+      LE("worker: poll() failed: %d = %s\n", n, strerror(n));
+      err = ACX1_WORKER_DIED;
       break;
     }
-    if (!sr) cmd = 'z'; else cmd = 0;
+    cmd = 0;
 
-    if (FD_ISSET(worker_pipe[0], &rfds))
+    if (pfd_a[0].revents)
     {
       LI("worker: reading from worker_pipe\n");
       n = read(worker_pipe[0], &cmd, 1);
@@ -673,130 +1716,37 @@ static void * worker_main (void * arg)
       }
     }
 
-    if (FD_ISSET(tty_fd, &rfds))
+    if (pfd_a[2].revents)
     {
-      LI("worker: reading from tty\n");
-      for (ofs = 0, mode = 0;
-           (n = read(tty_fd, &buf[ofs], sizeof(buf) - ofs)) > 0;
-           ofs = n - ofs)
-      {
-        if (mode == 1) continue; // consume all
-        LI("read(tty):%u \"%s\"\n", n, escstr(tmp, sizeof(tmp), buf, n));
-
-        pthread_mutex_lock(&mutex);
-        for (ofs = 0; ofs < n; ofs += ilen)
-        {
-          LI("decoding input (%u bytes): "
-             "%02X %02X %02X %02X %02X %02X %02X %02X\n",
-             n - ofs,
-             ofs + 0 < n ? buf[ofs + 0] : 0xFF,
-             ofs + 1 < n ? buf[ofs + 1] : 0xFF,
-             ofs + 2 < n ? buf[ofs + 2] : 0xFF,
-             ofs + 3 < n ? buf[ofs + 3] : 0xFF,
-             ofs + 4 < n ? buf[ofs + 4] : 0xFF,
-             ofs + 5 < n ? buf[ofs + 5] : 0xFF,
-             ofs + 6 < n ? buf[ofs + 6] : 0xFF,
-             ofs + 7 < n ? buf[ofs + 7] : 0xFF
-            );
-
-          di = decode_input(&buf[ofs], n - ofs, dec, &ilen, decode_mode);
-          if (di == DI_KEY)
-          {
-            LI("storing km=0x%X\n", dec[0]);
-            qpush1(dec[0]);
-            if (waiting_for_event && queue_len == 1)
-              pthread_cond_signal(&event_cond);
-            if (ilen == 0)
-            {
-              LE("BUG: ilen=0 at buf=\"%s\"\n", &buf[ofs]);
-              mode = 1;
-              break;
-            }
-            continue;
-          }
-          if (di == DI_ESC)
-          {
-            decode_mode = 0;
-            switch (dec[0])
-            {
-            case REPORT_CURSOR_POSITION_REPLY:
-              LI("got cursor pos: row %u, col %u\n", dec[1], dec[2]);
-              real_row = dec[1];
-              real_col = dec[2];
-              if (waiting_for_cursor) pthread_cond_signal(&cursor_cond);
-              if (!writing) { user_row = real_row; user_col = real_col; }
-              break;
-            default:
-              LI("ignoring escape 0x%X \"%.*s\"\n",
-                 dec[0], (int) ilen, &buf[ofs]);
-            }
-            continue;
-          }
-          if (di == DI_BAD)
-          {
-            LW("could not decode \"%s\" (ofs %u)\n",
-               escstr(tmp, sizeof(tmp), &buf[ofs], n - ofs), ofs);
-            mode = 1; // consume all
-            ofs = n;
-            break;
-          }
-          if (di == DI_MORE) break;
-        }
-        pthread_mutex_unlock(&mutex);
-
-        if (ofs < n)
-        {
-          memmove(&buf[0], &buf[ofs], n - ofs);
-        }
-
-      }
-
-      if (n < 0)
-      {
-        n = errno;
-        if (n == EINTR)
-        {
-          LI("read(tty) interrupted by signal\n");
-          continue;
-        }
-        if (n == EAGAIN)
-        {
-          LI("read(tty) finished input buffer\n");
-          continue;
-        }
-        LW("worker: read(tty) failed: %d = %s\n", n, strerror(n));
-        break;
-      }
-      if (n == 0) continue;
-      /*
-      {
-        LI("worker: tty closed\n");
-        break;
-      }
-      */
+      while (read(sig_fd, &si, sizeof(si)) == sizeof(si)) cmd = 'z';
     }
 
-    if (cmd == 'z')
+    if (pfd_a[1].revents & (POLLERR | POLLHUP | POLLNVAL))
     {
-      struct winsize wsz;
-      LI("reading terminal size...\n");
-      if (ioctl(tty_fd, TIOCGWINSZ, &wsz))
-      {
-        n = errno;
-        LW("failed to get terminal size with ioctl (error %d = %s)\n",
-           n, strerror(n));
-      }
-
-      pthread_mutex_lock(&mutex);
-      if (screen_height != wsz.ws_row || screen_width != wsz.ws_col)
-      {
-        screen_height = wsz.ws_row;
-        screen_width = wsz.ws_col;
-        screen_resized = 1;
-        if (waiting_for_event) pthread_cond_signal(&event_cond);
-      }
-      pthread_mutex_unlock(&mutex);
+      // keys that came before the hangup still go to the app
+      LW("worker: tty gone (poll events 0x%X)\n", pfd_a[1].revents);
+      if (pfd_a[1].revents & POLLIN) tty_input();
+      err = ACX1_TERM_IO_FAILED;
+      break;
     }
+    if (pfd_a[1].revents)
+    {
+      LI("worker: reading from tty\n");
+      if (tty_input()) { err = ACX1_TERM_IO_FAILED; break; }
+    }
+    in_flush();
+
+    if (cmd == 'z') size_check();
+  }
+  if (err)
+  {
+    // nothing comes from the tty anymore; readers get the error instead of
+    // waiting forever
+    pthread_mutex_lock(&mutex);
+    __atomic_store_n(&worker_error, err, __ATOMIC_RELEASE);
+    if (waiting_for_cursor) pthread_cond_signal(&cursor_cond);
+    pthread_mutex_unlock(&mutex);
+    wake_reader();
   }
   LI("exit worker\n");
 
@@ -805,11 +1755,20 @@ static void * worker_main (void * arg)
 
 /* acx1_init ****************************************************************/
 ACX1_API unsigned int ACX1_CALL acx1_init ()
+{
+  return acx1_init_ex(0);
+}
+
+/* acx1_init_ex *************************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_init_ex (uint32_t flags)
 {
   unsigned int rc;
   struct termios tio;
   struct winsize wsz;
   struct sigaction sa;
+  struct epoll_event ev;
+  sigset_t ss;
+  char query;
 
   /* init globals */
   tty_fd = -1;
@@ -818,18 +1777,59 @@ ACX1_API unsigned int ACX1_CALL acx1_init ()
   tio_set = 0;
   th_created = 0;
   mutex_created = 0;
-  event_cond_created = 0;
   cursor_cond_created = 0;
   waiting_for_event = 0;
   waiting_for_cursor = 0;
   screen_resized = 0;
-  queue_a = NULL;
+  finishing = 0;
+  read_event_done = 0;
+  event_fd = -1;
+  sig_fd = poll_fd = -1;
+  threadless = (flags & ACX1_NO_THREAD) != 0;
+  sigmask_set = 0;
+  in_state = IN_GROUND;
+  in_alt = in_pushed = 0;
+  u8_state = U8_ACCEPT;
+  paste_cur = paste_head = paste_given = NULL;
+  paste_tail_p = &paste_head;
+  paste_end_len = 0;
+  paste_lost = 0;
+  qprod_seg = qcons_seg = NULL;
+  queue_drops = 0;
   worker_error = 0;
   sigwinch_set = 0;
   writing = 0;
-
+  retained = 0;
+  front_valid = 0;
+  back_a = front_a = NULL;
+  obuf_a = NULL;
+  obuf_len = obuf_size = 0;
+  memset(&stats, 0, sizeof(stats));
+  term_attr_valid = 0;
+  term_row = term_col = 0;
+  resize_count = term_resize_count = 0;
+  term_caps = detect_term_caps(getenv("TERM"), getenv("COLORTERM"), &query);
+  caps_set = 0;
+  frame_sync = 0;
+
+  // SIGWINCH is read from sig_fd so it must stay blocked; the worker and
+  // threads the app creates after this inherit the mask
+  sigemptyset(&ss);
+  sigaddset(&ss, SIGWINCH);
+  Z(pthread_sigmask(SIG_BLOCK, &ss, &orig_sigmask), ACX1_SIGNAL_ERROR);
+  sigmask_set = 1;
+  sig_fd = signalfd(-1, &ss, SFD_NONBLOCK | SFD_CLOEXEC);
+  C(sig_fd >= 0, ACX1_SIGNAL_ERROR);
+
+  // older app threads may still take the signal; the handler forwards it
+  // through the pipe to the worker or, without one, to the epoll set (where
+  // a full pipe already has a resize pending, so it must not block)
   Z(pipe(worker_pipe), ACX1_CREATE_PIPE_ERROR);
-
+  if (threadless)
+  {
+    Z(fcntl(worker_pipe[0], F_SETFL, O_NONBLOCK), ACX1_CREATE_PIPE_ERROR);
+    Z(fcntl(worker_pipe[1], F_SETFL, O_NONBLOCK), ACX1_CREATE_PIPE_ERROR);
+  }
   sa.sa_flags = SA_SIGINFO;
   sigemptyset(&sa.sa_mask);
   sa.sa_sigaction = winch_signal;
@@ -839,8 +1839,8 @@ ACX1_API unsigned int ACX1_CALL acx1_init ()
   Z(pthread_mutex_init(&mutex, NULL), ACX1_THREAD_ERROR);
   mutex_created = 1;
 
-  Z(pthread_cond_init(&event_cond, NULL), ACX1_THREAD_ERROR);
-  event_cond_created = 1;
+  event_fd = eventfd(0, EFD_CLOEXEC);
+  C(event_fd >= 0, ACX1_CREATE_PIPE_ERROR);
 
   Z(pthread_cond_init(&cursor_cond, NULL), ACX1_THREAD_ERROR);
   cursor_cond_created = 1;
@@ -855,6 +1855,7 @@ ACX1_API unsigned int ACX1_CALL acx1_init ()
   Z(ioctl(tty_fd, TIOCGWINSZ, &wsz), ACX1_TERM_IO_FAILED);
   screen_height = wsz.ws_row;
   screen_width = wsz.ws_col;
+  term_width = screen_width;
   Z(tcflush(tty_fd, TCIOFLUSH), ACX1_TERM_IO_FAILED);
 
   tio = orig_tio;
@@ -873,20 +1874,36 @@ ACX1_API unsigned int ACX1_CALL acx1_init ()
   // z(tty_write_const(S7C1T), ACX1_TERM_IO_FAILED);
   // Z(tty_write_const(SET_ANSI_CONFORMANCE_LEVEL_1), ACX1_TERM_IO_FAILED);
   Z(tty_write_const(APPLICATION_KEYPAD), ACX1_TERM_IO_FAILED);
+  if (query)
+  {
+    Z(tty_write_const(REQUEST_SYNC_UPDATE_MODE), ACX1_TERM_IO_FAILED);
+  }
   Z(tty_write_const(REPORT_CURSOR_POSITION), ACX1_TERM_IO_FAILED);
   decode_mode = 1;
   Z(tty_write_const(SHOW_CURSOR), ACX1_TERM_IO_FAILED);
   cursor_mode = 1;
   Z(tty_write_const(NO_WRAPAROUND_MODE), ACX1_TERM_IO_FAILED);
   Z(tty_write_const(BACKARROW_SENDS_DEL), ACX1_TERM_IO_FAILED);
+  Z(tty_write_const(BRACKETED_PASTE_MODE), ACX1_TERM_IO_FAILED);
+
+  qprod_seg = qcons_seg = qseg_alloc(QUEUE_INIT_SHIFT);
+  C(qprod_seg, ACX1_NO_MEM);
 
-  queue_shift = 6;
-  queue_len = 0;
-  qx_mask = (1 << queue_shift) - 1;
-  qx_begin = 0;
-  qx_end  = 0;
-  queue_a = malloc(sizeof(uint32_t) << queue_shift);
-  C(queue_a, ACX1_NO_MEM);
+  if (threadless)
+  {
+    poll_fd = epoll_create1(EPOLL_CLOEXEC);
+    C(poll_fd >= 0, ACX1_CREATE_PIPE_ERROR);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = tty_fd;
+    Z(epoll_ctl(poll_fd, EPOLL_CTL_ADD, tty_fd, &ev), ACX1_CREATE_PIPE_ERROR);
+    ev.data.fd = sig_fd;
+    Z(epoll_ctl(poll_fd, EPOLL_CTL_ADD, sig_fd, &ev), ACX1_CREATE_PIPE_ERROR);
+    ev.data.fd = worker_pipe[0];
+    Z(epoll_ctl(poll_fd, EPOLL_CTL_ADD, worker_pipe[0], &ev),
+      ACX1_CREATE_PIPE_ERROR);
+    return 0;
+  }
 
   Z(pthread_create(&worker_th, NULL, worker_main, NULL), ACX1_THREAD_ERROR);
   th_created = 1;
@@ -903,7 +1920,7 @@ ACX1_API void ACX1_CALL acx1_finish ()
 {
   int i;
 
-  finishing = 1;
+  __atomic_store_n(&finishing, 1, __ATOMIC_RELAXED);
 
   if (sigwinch_set)
   {
@@ -952,10 +1969,10 @@ ACX1_API void ACX1_CALL acx1_finish ()
   {
       LI("locking mutex\n");
       pthread_mutex_lock(&mutex);
-      if (waiting_for_event)
+      if (__atomic_load_n(&waiting_for_event, __ATOMIC_RELAXED))
       {
           LI("siglaling read_event\n");
-          pthread_cond_signal(&event_cond);
+          wake_reader();
           while (!read_event_done)
           {
               LI("waiting for read_event to be done\n");
@@ -975,11 +1992,28 @@ ACX1_API void ACX1_CALL acx1_finish ()
               i, strerror(i));
   }
 
-  if (event_cond_created)
+  if (event_fd >= 0)
   {
-    i = pthread_cond_destroy(&event_cond);
-    if (i) LW("failed destroying event condition variable (error %d = %s)\n",
-              i, strerror(i));
+    if (close(event_fd))
+    {
+      i = errno;
+      LW("failed closing event fd (error %d = %s)\n", i, strerror(i));
+    }
+    event_fd = -1;
+  }
+
+  if (poll_fd >= 0) { close(poll_fd); poll_fd = -1; }
+  if (sig_fd >= 0) { close(sig_fd); sig_fd = -1; }
+  if (sigmask_set)
+  {
+    // drop a SIGWINCH still pending before unblocking it
+    struct timespec ts = { 0, 0 };
+    sigset_t ss;
+    sigemptyset(&ss);
+    sigaddset(&ss, SIGWINCH);
+    while (sigtimedwait(&ss, NULL, &ts) > 0);
+    pthread_sigmask(SIG_SETMASK, &orig_sigmask, NULL);
+    sigmask_set = 0;
   }
 
   if (cursor_cond_created)
@@ -989,7 +2023,30 @@ ACX1_API void ACX1_CALL acx1_finish ()
               i, strerror(i));
   }
 
-  if (queue_a) { free(queue_a); queue_a = NULL; }
+  while (qcons_seg)
+  {
+    qseg_t * s = qcons_seg;
+    qcons_seg = s->next;
+    free(s);
+  }
+  qprod_seg = NULL;
+  while (paste_head)
+  {
+    paste_t * p = paste_head;
+    paste_head = p->next;
+    free(p);
+  }
+  paste_tail_p = &paste_head;
+  free(paste_cur);
+  free(paste_given);
+  paste_cur = paste_given = NULL;
+  free(back_a);
+  free(front_a);
+  back_a = front_a = NULL;
+  retained = 0;
+  free(obuf_a);
+  obuf_a = NULL;
+  obuf_len = obuf_size = 0;
 
   if (tio_set)
   {
@@ -1004,6 +2061,7 @@ ACX1_API void ACX1_CALL acx1_finish ()
 
   if (tty_fd >= 0)
   {
+    tty_write_const(NO_BRACKETED_PASTE_MODE);
     tty_write_const(WRAPAROUND_MODE);
     tty_write_const(NORMAL_KEYPAD);
     tty_write_const(SHOW_CURSOR);
@@ -1028,62 +2086,229 @@ ACX1_API unsigned int ACX1_CALL acx1_get_screen_size (uint16_t * h, uint16_t * w
   return ACX1_OK;
 }
 
-/* acx1_read_event **********************************************************/
-ACX1_API unsigned int ACX1_CALL acx1_read_event (acx1_event_t * event_p)
+/* acx1_get_input_fd ********************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_get_input_fd (int * fd_p)
 {
-  unsigned int rc = 0;
+  if (!threadless) return ACX1_NOT_SUPPORTED;
+  *fd_p = poll_fd;
+  return 0;
+}
 
-  event_p->type = ACX1_NONE;
-  pthread_mutex_lock(&mutex);
+/* acx1_process_input *******************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_process_input ()
+{
+  struct signalfd_siginfo si;
+  char z[0x10];
+  int resized = 0;
+
+  if (!threadless) return ACX1_NOT_SUPPORTED;
+  while (read(sig_fd, &si, sizeof(si)) == sizeof(si)) resized = 1;
+  // SIGWINCH taken by a thread that does not block it
+  while (read(worker_pipe[0], z, sizeof(z)) > 0) resized = 1;
+  if (resized) size_check();
+  if (tty_input()) return ACX1_TERM_IO_FAILED;
+  in_flush();
+  return 0;
+}
 
-  for (;;)
+/* acx1_get_input_timeout ***************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_get_input_timeout (int * ms_p)
+{
+  if (!threadless) return ACX1_NOT_SUPPORTED;
+  *ms_p = in_timeout();
+  return 0;
+}
+
+/* acx1_set_esc_timeout *****************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_set_esc_timeout (unsigned int ms)
+{
+  __atomic_store_n(&esc_timeout, ms, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/* acx1_read_events *********************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_read_events
+(
+  acx1_event_t * events,
+  unsigned int max,
+  int timeout_ms,
+  unsigned int * count_p
+)
+{
+  struct pollfd pfd;
+  struct timespec now, end;
+  unsigned int rc = 0, n = 0;
+  uint64_t cnt;
+  uint32_t km;
+  unsigned int werr;
+  int tmo = timeout_ms, t, w;
+  paste_t * p;
+
+  // the app is done with the paste returned by the previous call
+  free(paste_given);
+  paste_given = NULL;
+
+  if (tmo > 0)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += tmo / 1000;
+    end.tv_nsec += (long) (tmo % 1000) * 1000000;
+    if (end.tv_nsec >= 1000000000)
+    {
+      end.tv_sec += 1;
+      end.tv_nsec -= 1000000000;
+    }
+  }
+
+  while (max)
   {
-    LI("read_event: checking event\n");
+    LI("read_events: checking events\n");
+    // without the worker the input stops here, with the same error event
+    if (threadless && !worker_error && acx1_process_input())
+      worker_error = ACX1_TERM_IO_FAILED;
 
-    if (finishing)
+    // keys need no lock; the flags are only peeked at before locking
+    if (__atomic_load_n(&finishing, __ATOMIC_RELAXED))
     {
-      LI("read_event: finishing\n");
-      event_p->type = ACX1_FINISH;
+      LI("read_events: finishing\n");
+      pthread_mutex_lock(&mutex);
+      events[0].type = ACX1_FINISH;
+      n = 1;
       read_event_done = 1;
       pthread_cond_signal(&read_event_done_cond);
+      pthread_mutex_unlock(&mutex);
       break;
     }
 
-    if (screen_resized)
+    // read before the queue so the keys queued before the worker stopped
+    // are all seen first
+    werr = __atomic_load_n(&worker_error, __ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(&screen_resized, __ATOMIC_RELAXED))
     {
-      LI("read_event: screen_resized\n");
+      LI("read_events: screen_resized\n");
+      pthread_mutex_lock(&mutex);
       screen_resized = 0;
-      event_p->type = ACX1_RESIZE;
-      event_p->size.w = screen_width;
-      event_p->size.h = screen_height;
+      events[n].type = ACX1_RESIZE;
+      events[n].size.w = screen_width;
+      events[n].size.h = screen_height;
+      ++n;
+      pthread_mutex_unlock(&mutex);
+    }
+
+    for (; n < max && qpop1(&km); ++n)
+    {
+      if (km == PASTE_KM)
+      {
+        // a paste ends the batch: there is a single paste_given
+        pthread_mutex_lock(&mutex);
+        p = paste_head;
+        paste_head = p->next;
+        if (!paste_head) paste_tail_p = &paste_head;
+        pthread_mutex_unlock(&mutex);
+        LI("read_events: paste of %u bytes\n", (unsigned int) p->len);
+        paste_given = p;
+        events[n].type = ACX1_PASTE;
+        events[n].paste.data = p->data;
+        events[n].paste.len = p->len;
+        ++n;
+        break;
+      }
+      LI("read_events: key_press 0x%X\n", km);
+      events[n].type = ACX1_KEY;
+      events[n].km = km;
+    }
+    if (!n && werr)
+    {
+      LI("read_events: worker stopped (%u)\n", werr);
+      events[0].type = ACX1_ERROR;
+      n = 1;
+      rc = werr;
       break;
     }
+    if (n || !tmo) break;
 
-    if (queue_len)
+    if (threadless) pfd.fd = poll_fd;
+    else if (!__atomic_load_n(&waiting_for_event, __ATOMIC_RELAXED))
     {
-      LI("read_event: key_press; queue_len=%d\n", queue_len);
-      event_p->type = ACX1_KEY;
-      event_p->km = qpop1();
+      // announce the wait, then look once more before sleeping; see
+      // wake_reader()
+      __atomic_store_n(&waiting_for_event, 1, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      continue;
+    }
+    else pfd.fd = event_fd;
+
+    // without the worker, wake up to time out a pending ESC too
+    w = tmo;
+    if (threadless && (t = in_timeout()) >= 0 && (w < 0 || t < w)) w = t;
+    LI("read_events: waiting for events (timeout %d ms)\n", w);
+    pfd.events = POLLIN;
+    switch (poll(&pfd, 1, w))
+    {
+    case -1:
+      if (errno != EINTR) { rc = ACX1_WORKER_DIED; goto l_exit; }
+      break;
+    case 0:
       break;
+    default:
+      if (threadless) break;
+      if (read(event_fd, &cnt, sizeof(cnt)) < 0 && errno != EINTR)
+      {
+        rc = ACX1_WORKER_DIED;
+        goto l_exit;
+      }
     }
+    __atomic_store_n(&waiting_for_event, 0, __ATOMIC_RELAXED);
 
-    LI("read_event: waiting for event\n");
-    waiting_for_event = 1;
-    pthread_cond_wait(&event_cond, &mutex);
-    waiting_for_event = 0;
+    if (tmo > 0)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (now.tv_sec > end.tv_sec ||
+          (now.tv_sec == end.tv_sec && now.tv_nsec >= end.tv_nsec)) tmo = 0;
+      else tmo = (int) ((end.tv_sec - now.tv_sec) * 1000 +
+                        (end.tv_nsec - now.tv_nsec + 999999) / 1000000);
+    }
   }
-//l_fail:
-  pthread_mutex_unlock(&mutex);
+l_exit:
+  __atomic_store_n(&waiting_for_event, 0, __ATOMIC_RELAXED);
+  *count_p = n;
+
+  return rc;
+}
+
+/* acx1_read_event **********************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_read_event (acx1_event_t * event_p)
+{
+  unsigned int rc, n;
 
+  rc = acx1_read_events(event_p, 1, -1, &n);
+  if (!n) event_p->type = ACX1_NONE;
   return rc;
 }
 
 /* acx1_get_cursor_pos ******************************************************/
 ACX1_API unsigned int ACX1_CALL acx1_get_cursor_pos (uint16_t * r, uint16_t * c)
 {
+  struct pollfd pfd;
+
+  // without the worker the reply to the position query is read here
+  while (threadless && !real_row)
+  {
+    pfd.fd = tty_fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) return ACX1_TERM_IO_FAILED;
+    if (acx1_process_input()) return ACX1_TERM_IO_FAILED;
+  }
+
   pthread_mutex_lock(&mutex);
   while (!real_row)
   {
+    if (worker_error)
+    {
+      pthread_mutex_unlock(&mutex);
+      return worker_error;
+    }
     waiting_for_cursor = 1;
     pthread_cond_wait(&cursor_cond, &mutex);
     waiting_for_cursor = 0;
@@ -1108,13 +2333,16 @@ ACX1_API unsigned int ACX1_CALL acx1_set_cursor_pos (uint16_t r, uint16_t c)
     user_col = c;
     rc = 0;
   }
-  else rc = -1;
+  else
+  {
+    rc = -1;
+    term_sync();
+  }
   pthread_mutex_unlock(&mutex);
   if (rc >= 0) return rc;
 
-  cpos_len = set_cursor_pos_str(buf, r, c);
-  sprintf((char *) buf, "\e[%u;%uH", r, c);
-  if (tty_write(buf, cpos_len)) return ACX1_TERM_IO_FAILED;
+  cpos_len = cursor_move_str(buf, r, c);
+  if (cpos_len && tty_write(buf, cpos_len)) return ACX1_TERM_IO_FAILED;
 
   pthread_mutex_lock(&mutex);
   user_row = real_row = r;
@@ -1126,7 +2354,8 @@ ACX1_API unsigned int ACX1_CALL acx1_set_cursor_pos (uint16_t r, uint16_t c)
 /* acx1_write_pos ***********************************************************/
 ACX1_API unsigned int ACX1_CALL acx1_write_pos (uint16_t r, uint16_t c)
 {
-  char buf[0x40];
+  uint8_t buf[0x40];
+  uint_t len;
   int rc;
 
   pthread_mutex_lock(&mutex);
@@ -1139,9 +2368,15 @@ ACX1_API unsigned int ACX1_CALL acx1_write_pos (uint16_t r, uint16_t c)
   }
   pthread_mutex_unlock(&mutex);
   if (rc >= 0) return rc;
+  if (retained)
+  {
+    pen_row = r;
+    pen_col = c;
+    return 0;
+  }
 
-  sprintf(buf, "\e[%u;%uH", r, c);
-  if (tty_write(buf, strlen(buf))) return ACX1_TERM_IO_FAILED;
+  len = cursor_move_str(buf, r, c);
+  if (len && out_write(buf, len)) return ACX1_TERM_IO_FAILED;
 
   return 0;
 }
@@ -1150,24 +2385,111 @@ ACX1_API unsigned int ACX1_CALL acx1_write_pos (uint16_t r, uint16_t c)
 ACX1_API unsigned int ACX1_CALL acx1_clear ()
 {
   unsigned int rc;
-  uint16_t r;
+  uint16_t h, w;
+
+  pthread_mutex_lock(&mutex);
+  rc = !writing ? ACX1_NOT_WRITING : 0;
+  h = screen_height;
+  w = screen_width;
+  pthread_mutex_unlock(&mutex);
+  if (rc) return rc;
+  if (!retained && term_attr_valid && can_erase(&term_attr))
+    return out_write_const(CLEAR_ALL_SCREEN) ? ACX1_TERM_IO_FAILED : ACX1_OK;
+  return acx1_clear_rect(1, 1, h, w);
+}
+
+/* acx1_clear_rect **********************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_clear_rect
+(
+  uint16_t r,
+  uint16_t c,
+  uint16_t h,
+  uint16_t w
+)
+{
+  unsigned int rc;
+  uint8_t buf[0x40];
+  uint_t len;
+  uint16_t sh, sw, i;
+
   pthread_mutex_lock(&mutex);
   rc = !writing ? ACX1_NOT_WRITING : 0;
+  sh = screen_height;
+  sw = screen_width;
+  if (!retained) term_sync();
   pthread_mutex_unlock(&mutex);
   if (rc) return rc;
-  for (r = 1; r <= screen_height; ++r)
+  if (retained)
+  {
+    rc = cells_sync_size();
+    if (!rc) cells_clear_rect(r, c, h, w);
+    return rc;
+  }
+
+  if (!r || !c || r > sh || c > sw) return 0;
+  if (h > sh - r + 1) h = sh - r + 1;
+  if (w > sw - c + 1) w = sw - c + 1;
+  if (!h || !w) return 0;
+  if (c == 1 && w == sw && r + h - 1 == sh &&
+      term_attr_valid && can_erase(&term_attr))
+  {
+    // everything from the start of row r to the end of the screen
+    len = cursor_move_str(buf, r, 1);
+    memcpy(&buf[len], "\e[J", 3);
+    len += 3;
+    return out_write(buf, len) ? ACX1_TERM_IO_FAILED : ACX1_OK;
+  }
+  for (i = 0; i < h; ++i)
   {
-    rc = acx1_write_pos(r, 1);
+    rc = acx1_write_pos(r + i, c);
     if (rc) return rc;
-    rc = acx1_fill(' ', screen_width);
+    rc = acx1_fill(' ', w);
     if (rc) return rc;
   }
-
-  // Z(tty_write_const(CLEAR_ALL_SCREEN), ACX1_TERM_IO_FAILED); 
   return 0;
+}
+
+/* acx1_scroll **************************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_scroll
+(
+  uint16_t top,
+  uint16_t bottom,
+  int n
+)
+{
+  unsigned int rc;
+  uint8_t buf[0x40];
+  uint_t len;
+  uint16_t sh;
+  cell_t fill;
+
+  pthread_mutex_lock(&mutex);
+  rc = !writing ? ACX1_NOT_WRITING : 0;
+  sh = screen_height;
+  if (!retained) term_sync();
+  pthread_mutex_unlock(&mutex);
+  if (rc) return rc;
+  if (retained)
+  {
+    rc = cells_sync_size();
+    if (rc) return rc;
+    sh = cells_height;
+  }
 
-// l_fail:
-//   return rc;
+  if (bottom > sh) bottom = sh;
+  if (!top || top > bottom || !n) return 0;
+  if (n > bottom - top + 1) n = bottom - top + 1;
+  if (n < top - bottom - 1) n = top - bottom - 1;
+  if (retained)
+  {
+    // the diff in acx1_present() finds the shift and scrolls the terminal
+    fill.ch = ' ';
+    fill.attr = pen_attr;
+    cells_shift(back_a, top - 1, bottom - 1, n, &fill);
+    return 0;
+  }
+  len = scroll_str(buf, top, bottom, sh, n);
+  return out_write(buf, len) ? ACX1_TERM_IO_FAILED : ACX1_OK;
 }
 
 /* acx1_get_cursor_mode *****************************************************/
@@ -1204,11 +2526,26 @@ ACX1_API unsigned int ACX1_CALL acx1_write_start ()
   else
   {
     writing = 1;
+    term_sync();
+    pen_row = real_row;
+    pen_col = real_col;
+    frame_sync = (term_caps & ACX1_CAP_SYNC) != 0;
     rc = ACX1_OK;
   }
   pthread_mutex_unlock(&mutex);
   if (rc) goto l_fail;
-  Z(tty_write_const(HIDE_CURSOR), ACX1_TERM_IO_FAILED);
+  if (retained && (rc = cells_sync_size()))
+  {
+    pthread_mutex_lock(&mutex);
+    writing = 0;
+    pthread_mutex_unlock(&mutex);
+    goto l_fail;
+  }
+  if (frame_sync)
+  {
+    Z(out_write_const(BEGIN_SYNC_UPDATE), ACX1_TERM_IO_FAILED);
+  }
+  Z(out_write_const(HIDE_CURSOR), ACX1_TERM_IO_FAILED);
 l_fail:
   return rc;
 }
@@ -1217,40 +2554,97 @@ l_fail:
 ACX1_API unsigned int ACX1_CALL acx1_write_stop ()
 {
   unsigned int rc, r, c;
+  uint8_t buf[0x40];
   int cm;
 
   pthread_mutex_lock(&mutex);
-  writing = 0;
   cm = cursor_mode;
   r = user_row;
   c = user_col;
   pthread_mutex_unlock(&mutex);
-  if (cm && tty_write_const(SHOW_CURSOR)) rc = ACX1_TERM_IO_FAILED;
-  rc = acx1_set_cursor_pos(r, c);
+
+  rc = retained ? cells_present() : ACX1_OK;
+  if (cm && out_write_const(SHOW_CURSOR) && !rc) rc = ACX1_TERM_IO_FAILED;
+  if (out_write(buf, cursor_move_str(buf, r, c)) && !rc)
+    rc = ACX1_TERM_IO_FAILED;
+  if (frame_sync && out_write_const(END_SYNC_UPDATE) && !rc)
+    rc = ACX1_TERM_IO_FAILED;
+  if (out_flush() && !rc) rc = ACX1_TERM_IO_FAILED;
+
+  pthread_mutex_lock(&mutex);
+  writing = 0;
+  real_row = r;
+  real_col = c;
+  stats.frames += 1;
+  pthread_mutex_unlock(&mutex);
   return rc;
 }
 
+/* acx1_flush ***************************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_flush ()
+{
+  return out_flush() ? ACX1_TERM_IO_FAILED : ACX1_OK;
+}
+
+/* acx1_get_stats ***********************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_get_stats (acx1_stats_t * stats_p)
+{
+  *stats_p = stats;
+  stats_p->events_dropped = __atomic_load_n(&queue_drops, __ATOMIC_RELAXED);
+  return 0;
+}
+
 /* acx1_write ***************************************************************/
 ACX1_API unsigned int ACX1_CALL acx1_write (void const * data, size_t len)
 {
-  return tty_write(data, len) ? ACX1_TERM_IO_FAILED : ACX1_OK;
+  size_t bl, cl, wl;
+
+  if (retained) return cells_write(data, len);
+  if (out_write(data, len)) return ACX1_TERM_IO_FAILED;
+  if (acx1_utf8_str_measure(acx1_term_char_width_wctx, NULL, data, len,
+                            SIZE_MAX, SIZE_MAX, &bl, &cl, &wl))
+    term_row = term_col = 0; // control chars or bad utf8: cursor unknown
+  else term_advance(wl);
+  return ACX1_OK;
 }
 
 /* acx1_fill ****************************************************************/
 ACX1_API unsigned int ACX1_CALL acx1_fill (uint32_t ch, uint16_t count)
 {
-  char buf[0x40];
-  unsigned int bl;
+  uint8_t buf[0x40];
+  uint8_t g[4];
+  int cw, gl;
+  uint_t bl, len;
+
+  if (retained) return cells_fill(ch, count);
+  cw = ch < 0x110000 ? acx1_term_char_width(ch) : -1;
+  gl = acx1_utf8_char_encode(g, ch);
+  if (cw <= 0 || gl <= 0) return ACX1_NO_CODE;
+  if (!count) return ACX1_OK;
+
+  if (ch == ' ' && (len = erase_str(buf, count)))
+    return out_write(buf, len) ? ACX1_TERM_IO_FAILED : ACX1_OK;
+
+  if ((term_caps & ACX1_CAP_REP) && count > 1)
+  {
+    memcpy(buf, g, gl);
+    len = gl + csi_move_str(&buf[gl], count - 1, 0, 'b');
+    if (len < (uint_t) gl * count)
+    {
+      if (out_write(buf, len)) return ACX1_TERM_IO_FAILED;
+      term_advance((size_t) cw * count);
+      return ACX1_OK;
+    }
+  }
 
-  if (ch >= 0x7F) return ACX1_NO_CODE;
-  bl = sizeof(buf);
-  if (bl > count) bl = count;
-  memset(buf, ch, bl);
+  for (bl = 0; bl < sizeof(buf) / gl && bl < count; ++bl)
+    memcpy(&buf[bl * gl], g, gl);
   while (count)
   {
     if (count < bl) bl = count;
-    if (tty_write(buf, bl)) break;
+    if (out_write(buf, bl * gl)) break;
     count -= bl;
+    term_advance((size_t) cw * bl);
   }
 
   return count ? ACX1_TERM_IO_FAILED : ACX1_OK;
@@ -1266,8 +2660,20 @@ ACX1_API unsigned int ACX1_CALL acx1_attr
 {
   uint8_t buf[0x80];
   uint_t len;
-  len = set_attr_str(buf, bg, fg, mode);
-  return tty_write(buf, len) ? ACX1_TERM_IO_FAILED : ACX1_OK;
+  acx1_attr_t a;
+
+  if (bg < 0 || fg < 0) return ACX1_NO_CODE;
+  a.bg = bg;
+  a.fg = fg;
+  a.mode = mode;
+  if (retained)
+  {
+    pen_attr = a;
+    return 0;
+  }
+  len = attr_update_str(buf, &a);
+  if (!len) return ACX1_OK;
+  return out_write(buf, len) ? ACX1_TERM_IO_FAILED : ACX1_OK;
 }
 
 /* acx1_rect ****************************************************************/
@@ -1281,15 +2687,77 @@ ACX1_API uint_t ACX1_CALL acx1_rect
   acx1_attr_t * attrs
 )
 {
-  static uint8_t buf[0x10000];
-#define BLIM (sizeof(buf) - 0x80)
+  return acx1_rect_ofs(data, start_row, start_col, row_num, col_num, 0, attrs);
+}
+
+/* acx1_rect_ofs ************************************************************/
+ACX1_API uint_t ACX1_CALL acx1_rect_ofs
+(
+  uint8_t const * const * data,
+  uint16_t start_row,
+  uint16_t start_col,
+  uint16_t row_num,
+  uint16_t col_num,
+  uint32_t col_ofs,
+  acx1_attr_t * attrs
+)
+{
+  acx1_row_t rows[0x40];
+  uint_t i, k, n, rc;
+
+  // measure a batch of rows at a time and hand them to acx1_rect_rows()
+  for (i = 0; i < row_num && start_row + i <= 0xFFFF; i += n)
+  {
+    n = row_num - i < ACX1_ITEM_COUNT(rows) ? row_num - i
+                                            : ACX1_ITEM_COUNT(rows);
+    for (k = 0; k < n; ++k)
+    {
+      rows[k].data = data[i + k];
+      rows[k].len = strlen((char const *) data[i + k]);
+    }
+    rc = acx1_rect_rows(rows, NULL, start_row + i, start_col, n, col_num,
+                        col_ofs, attrs);
+    if (rc) return rc;
+  }
+  return 0;
+}
+
+/* acx1_rect_rows ***********************************************************/
+ACX1_API uint_t ACX1_CALL acx1_rect_rows
+(
+  acx1_row_t const * rows,
+  uint32_t const * widths,
+  uint16_t start_row,
+  uint16_t start_col,
+  uint16_t row_num,
+  uint16_t col_num,
+  uint32_t col_ofs,
+  acx1_attr_t * attrs
+)
+{
   int rc;
-  int chunk_attr = 0, crt_attr = -1;
-  uint_t i, row_ofs; // byte offset in current row
-  int row_width_left = 0; // width left in current row
+  int chunk_attr, crt_attr = -1, split;
+  uint_t i;
+  size_t row_ofs; // byte offset in current row
+  size_t row_len;
+  size_t row_width_left; // width left in current row
   size_t chunk_len, chunk_cps, chunk_width;
-  size_t buf_len;
-  char new_line;
+  uint8_t const * row;
+  uint8_t const * p;
+  uint8_t const * q;
+  uint8_t const * e;
+
+  if (retained)
+  {
+    rc = cells_sync_size();
+    if (rc) return rc;
+    return cells_rect(rows, start_row, start_col, row_num, col_num, col_ofs,
+                      attrs);
+  }
+
+  pthread_mutex_lock(&mutex);
+  term_sync();
+  pthread_mutex_unlock(&mutex);
 
   /* easy peasy? */
   if (start_row > screen_height || start_col > screen_width) return 0;
@@ -1297,86 +2765,199 @@ ACX1_API uint_t ACX1_CALL acx1_rect
   if (row_num > screen_height - start_row + 1) row_num = screen_height - start_row + 1;
   if (col_num > screen_width - start_col + 1) col_num = screen_width - start_col + 1;
 
-  for (new_line = 1, row_ofs = 0, i = 0, buf_len = 0; i < row_num; )
+  // everything goes to the output buffer; outside acx1_write_start() /
+  // acx1_write_stop() it is sent when the rect is done
+  rc = 0;
+  for (i = 0; i < row_num; ++i)
   {
-    //LI("nl=%u,row_ofs=0x%X,row=0x%X,buf_len=0x%X,width_left=0x%X\n", new_line, row_ofs, i, (int) buf_len, row_width_left);
-    if (buf_len >= BLIM) goto l_write;
-
-    if (new_line)
+    row = rows[i].data;
+    row_len = rows[i].len;
+    if (obuf_reserve(0x100)) { rc = ACX1_NO_MEM; break; }
+    obuf_len += cursor_move_str(&obuf_a[obuf_len], start_row + i, start_col);
+    row_ofs = 0;
+    row_width_left = col_num;
+    chunk_attr = 0;
+    if (widths && col_ofs >= widths[i])
     {
-      buf_len += set_cursor_pos_str(&buf[buf_len], start_row + i, start_col);
-      new_line = 0;
-      row_ofs = 0;
-      row_width_left = col_num;
-      chunk_attr = 0;
+      // scrolled out of view; only the escapes matter, for the padding
+      for (p = row; (p = memchr(p, '\a', row + row_len - p)) != NULL &&
+                    p + 1 < row + row_len; p += 2)
+        chunk_attr = p[1];
+      row_ofs = row_len;
     }
-
-    if (data[i][row_ofs] == 0)
+    else if (col_ofs)
     {
-      //LI("end of row. buf_len=0x%X, width_left=0x%X\n", (int) buf_len, row_width_left);
-      // end of row
-      if (row_width_left)
+      if (rect_row_skip(row, row_len, col_ofs, &row_ofs, &chunk_attr, &split))
       {
-        if (buf_len + row_width_left >= BLIM) chunk_len = BLIM - buf_len;
-        else chunk_len = row_width_left;
-        //LI("clearing to EOL. len=0x%X\n", (int) chunk_len);
-        memset(&buf[buf_len], ' ', chunk_len);
-        row_width_left -= chunk_len;
-        buf_len += chunk_len;
-        if (row_width_left) goto l_write;
+        rc = ACX1_BAD_DATA;
+        goto l_exit;
+      }
+      if (split && row_width_left)
+      {
+        // right half of a wide char cut by the left edge
+        if (chunk_attr != crt_attr)
+        {
+          crt_attr = chunk_attr;
+          obuf_len += attr_update_str(&obuf_a[obuf_len], &attrs[crt_attr]);
+        }
+        obuf_a[obuf_len++] = ' ';
+        row_width_left--;
+        term_advance(1);
       }
-
-      new_line = 1;
-      ++i;
-      continue;
     }
-    else if (data[i][row_ofs] == '\a')
+    else if (widths && widths[i] <= col_num)
     {
-      // attr change
-      chunk_attr = data[i][row_ofs + 1];
-      row_ofs += 2;
-      continue;
+      // the whole row fits; copy the text between escapes once it is known
+      // to be valid utf8 without controls (C0, DEL and C1 as C2 80..C2 9F)
+      while (row_ofs < row_len)
+      {
+        p = memchr(row + row_ofs, '\a', row_len - row_ofs);
+        chunk_len = (p ? (size_t) (p - row) : row_len) - row_ofs;
+        e = row + row_ofs + chunk_len;
+        for (q = row + row_ofs; q < e; ++q)
+          if (*q < 0x20 || *q == 0x7F ||
+              (*q == 0xC2 && q + 1 < e && q[1] < 0xA0)) break;
+        if (q < e ||
+            acx1_utf8_validate(row + row_ofs, chunk_len) != chunk_len)
+        {
+          rc = ACX1_BAD_DATA;
+          goto l_exit;
+        }
+        if (chunk_len)
+        {
+          if (obuf_reserve(chunk_len + 0x80)) { rc = ACX1_NO_MEM; goto l_exit; }
+          if (chunk_attr != crt_attr)
+          {
+            crt_attr = chunk_attr;
+            obuf_len += attr_update_str(&obuf_a[obuf_len], &attrs[crt_attr]);
+          }
+          memcpy(&obuf_a[obuf_len], row + row_ofs, chunk_len);
+          obuf_len += chunk_len;
+          row_ofs += chunk_len;
+        }
+        if (!p || row_len - row_ofs < 2) break;
+        chunk_attr = row[row_ofs + 1];
+        row_ofs += 2;
+      }
+      row_ofs = row_len;
+      row_width_left -= widths[i];
+      term_advance(widths[i]);
     }
 
-    //LI("measure(blim=0x%X,wlim=0x%X,str:%s)\n", (int) (BLIM - buf_len), row_width_left, data[i] + row_ofs);
-    rc = acx1_utf8_str_measure(acx1_term_char_width_wctx, NULL, data[i] + row_ofs,
-                              BLIM - buf_len, SSIZE_MAX, row_width_left, 
-                              &chunk_len, &chunk_cps, &chunk_width);
-    //LI(".. rc=%d: len=0x%X, cps=0x%X, width=0x%X\n", rc, (int) chunk_len, (int) chunk_cps, (int) chunk_width);
-    if (rc < 0 && !chunk_len)
+    while (row_ofs < row_len)
     {
-      // malformed utf8; this could happen because of passing a truncated line
-      if (buf_len >= BLIM - 4) goto l_write; // maybe we truncated the input
-      // there's enough room to output one codepoint so the string is malformed
-      // or there's a non-printable other than NUL and \a
-      //LI("passed bad data\n");
-      return ACX1_BAD_DATA;
+      if (row[row_ofs] == '\a')
+      {
+        // attr change
+        if (row_len - row_ofs < 2) break;
+        chunk_attr = row[row_ofs + 1];
+        row_ofs += 2;
+        continue;
+      }
+
+      rc = acx1_utf8_str_measure(acx1_term_char_width_wctx, NULL,
+                                 row + row_ofs, row_len - row_ofs, SIZE_MAX,
+                                 row_width_left,
+                                 &chunk_len, &chunk_cps, &chunk_width);
+      if (chunk_len)
+      {
+        if (obuf_reserve(chunk_len + 0x80)) { rc = ACX1_NO_MEM; goto l_exit; }
+        if (chunk_attr != crt_attr)
+        {
+          crt_attr = chunk_attr;
+          obuf_len += attr_update_str(&obuf_a[obuf_len], &attrs[crt_attr]);
+        }
+        memcpy(&obuf_a[obuf_len], row + row_ofs, chunk_len);
+        obuf_len += chunk_len;
+        row_ofs += chunk_len;
+        row_width_left -= chunk_width;
+        term_advance(chunk_width);
+      }
+      if (rc == 2 || row_ofs == row_len) break; // row full or end of row
+      if (row[row_ofs] != '\a')
+      {
+        // malformed utf8 or a non-printable other than \a
+        rc = ACX1_BAD_DATA;
+        goto l_exit;
+      }
     }
+    rc = 0;
 
-    if (chunk_attr != crt_attr)
+    if (row_width_left)
     {
-      crt_attr = chunk_attr;
-      buf_len += set_attr_str(&buf[buf_len], 
-                              attrs[crt_attr].bg, attrs[crt_attr].fg,
-                              attrs[crt_attr].mode);
+      // pad the rest of the row using the last attribute selected in it
+      if (obuf_reserve(row_width_left + 0x80)) { rc = ACX1_NO_MEM; break; }
+      if (chunk_attr != crt_attr)
+      {
+        crt_attr = chunk_attr;
+        obuf_len += attr_update_str(&obuf_a[obuf_len], &attrs[crt_attr]);
+      }
+      chunk_len = erase_str(&obuf_a[obuf_len], row_width_left);
+      if (!chunk_len)
+      {
+        memset(&obuf_a[obuf_len], ' ', row_width_left);
+        chunk_len = row_width_left;
+        term_advance(row_width_left);
+      }
+      obuf_len += chunk_len;
     }
-    memcpy(&buf[buf_len], data[i] + row_ofs, chunk_len);
-    buf_len += chunk_len;
-    row_ofs += chunk_len;
-    row_width_left -= chunk_width;
-    if (!row_width_left) { new_line = 1; ++i; continue; }
-    if (buf_len < BLIM - 4) continue;
-
-l_write:
-    //LI("writing %lu bytes\n", buf_len);
-    if (tty_write(buf, buf_len)) return ACX1_TERM_IO_FAILED;
-    buf_len = 0;
   }
 
-  //LI("writing %lu bytes\n", buf_len);
-  if (buf_len && tty_write(buf, buf_len)) return ACX1_TERM_OPEN_FAILED;
+l_exit:
+  // send what was prepared so far to keep cursor/attr tracking exact
+  if (!writing && out_flush() && !rc) rc = ACX1_TERM_IO_FAILED;
+  return rc;
+}
+
+/* acx1_get_caps ************************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_get_caps (uint32_t * caps_p)
+{
+  pthread_mutex_lock(&mutex);
+  *caps_p = term_caps;
+  pthread_mutex_unlock(&mutex);
+  return 0;
+}
 
+/* acx1_set_caps ************************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_set_caps (uint32_t caps)
+{
+  pthread_mutex_lock(&mutex);
+  term_caps = caps;
+  caps_set = 1;
+  pthread_mutex_unlock(&mutex);
   return 0;
 }
 
+/* acx1_retained_mode *******************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_retained_mode (unsigned int enable)
+{
+  unsigned int rc;
+
+  if (writing) return ACX1_ALREADY_WRITING;
+  front_valid = 0;
+  if (!enable)
+  {
+    free(back_a);
+    free(front_a);
+    back_a = front_a = NULL;
+    retained = 0;
+    return 0;
+  }
+  rc = cells_sync_size();
+  retained = !rc;
+  return rc;
+}
+
+/* acx1_present *************************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_present ()
+{
+  unsigned int rc;
+
+  if (!retained) return ACX1_NOT_SUPPORTED;
+  if (writing) return cells_present();
+  rc = acx1_write_start();
+  if (rc) return rc;
+  return acx1_write_stop();
+}
+
 #endif
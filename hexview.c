@@ -0,0 +1,408 @@
+/* acx1 - Application Console Interface - ver. 1
+ *
+ * Hex viewer for files of any size.
+ * Only a window of the file around the displayed rows is mapped in memory,
+ * so going to any offset costs one remap and touches just the pages shown.
+ *
+ * This program can be used to test acx1 library.
+ *
+ */
+#define _POSIX_C_SOURCE 200809
+#define _FILE_OFFSET_BITS 64
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <acx1.h>
+
+/* size of the mapped window; rounded up to the page size at open */
+#define MAP_WINDOW (1 << 20)
+
+#define MAX_ROW_BYTES 32
+
+int ofs_bg = 0, ofs_fg = 6;
+int hex_bg = 0, hex_fg = 7;
+int txt_bg = 0, txt_fg = 2;
+int bar_bg = 4, bar_fg = 15;
+
+FILE * log_file = NULL;
+
+#define A(_expr) if (!(rc = (_expr))) ; else \
+                    do { line = __LINE__; goto l_acx_fail; } while (0)
+
+typedef struct hexview_s
+{
+  int fd;
+  uint64_t size;
+  uint8_t * map;
+  uint64_t map_ofs;
+  size_t map_len;
+  size_t map_win;
+  size_t page_size;
+} hexview_t;
+
+/* hv_open ******************************************************************/
+int hv_open (hexview_t * hv, char const * path)
+{
+  struct stat st;
+  long ps;
+
+  memset(hv, 0, sizeof(hexview_t));
+  hv->fd = open(path, O_RDONLY);
+  if (hv->fd < 0) return -1;
+  if (fstat(hv->fd, &st)) goto l_fail;
+  if (!S_ISREG(st.st_mode)) { errno = EINVAL; goto l_fail; }
+  hv->size = st.st_size;
+  ps = sysconf(_SC_PAGESIZE);
+  hv->page_size = ps > 0 ? ps : 0x1000;
+  hv->map_win = (MAP_WINDOW + hv->page_size - 1) & ~(hv->page_size - 1);
+  return 0;
+l_fail:
+  close(hv->fd);
+  return -1;
+}
+
+/* hv_close *****************************************************************/
+void hv_close (hexview_t * hv)
+{
+  if (hv->map) munmap(hv->map, hv->map_len);
+  close(hv->fd);
+}
+
+/* hv_get *******************************************************************/
+/* returns a pointer to len bytes at file offset ofs, remapping the window
+ * when they are not inside it; the range must be within the file */
+uint8_t const * hv_get (hexview_t * hv, uint64_t ofs, size_t len)
+{
+  uint64_t start;
+  size_t n;
+  void * p;
+
+  if (hv->map && ofs >= hv->map_ofs && ofs + len <= hv->map_ofs + hv->map_len)
+    return hv->map + (ofs - hv->map_ofs);
+  if (hv->map) { munmap(hv->map, hv->map_len); hv->map = NULL; }
+
+  // center the window on the requested range so small moves either way
+  // stay inside it; the margins cover the alignment of the start
+  n = len + 2 * hv->page_size > hv->map_win ? len + 2 * hv->page_size
+    : hv->map_win;
+  start = ofs > (n - len) / 2 ? ofs - (n - len) / 2 : 0;
+  start &= ~(uint64_t) (hv->page_size - 1);
+  if (hv->size - start < n) n = hv->size - start;
+  p = mmap(NULL, n, PROT_READ, MAP_SHARED, hv->fd, start);
+  if (p == MAP_FAILED) return NULL;
+  hv->map = p;
+  hv->map_ofs = start;
+  hv->map_len = n;
+  return hv->map + (ofs - start);
+}
+
+/* put **********************************************************************/
+/* writes at most *room bytes of s and takes them out of *room */
+unsigned int put (char const * s, size_t n, size_t * room)
+{
+  if (n > *room) n = *room;
+  *room -= n;
+  return n ? acx1_write(s, n) : 0;
+}
+
+/* format_row ***************************************************************/
+/* formats one row as offset, hex bytes in groups of 8 and their text; the
+ * lengths of the three parts are stored in part_a */
+size_t format_row (char * out, uint64_t ofs, uint8_t const * data, size_t n,
+                   unsigned int od, unsigned int bpr, size_t * part_a)
+{
+  uint8_t be[8];
+  char hx[MAX_ROW_BYTES * 2 + 1];
+  char * o = out;
+  unsigned int j;
+
+  for (j = 0; j < 8; ++j) be[j] = (uint8_t) (ofs >> (56 - 8 * j));
+  acx1_hexz(hx, be, 8);
+  memcpy(o, hx + 16 - od, od);
+  o += od;
+  part_a[0] = od;
+
+  acx1_hexz(hx, data, n);
+  *o++ = ' ';
+  for (j = 0; j < bpr; ++j)
+  {
+    if (!(j & 7)) *o++ = ' ';
+    if (j < n) { o[0] = hx[2 * j]; o[1] = hx[2 * j + 1]; }
+    else o[0] = o[1] = ' ';
+    o[2] = ' ';
+    o += 3;
+  }
+  *o++ = ' ';
+  part_a[1] = o - out - part_a[0];
+
+  for (j = 0; j < n; ++j)
+    *o++ = data[j] >= 0x20 && data[j] < 0x7F ? data[j] : '.';
+  for (; j < bpr; ++j) *o++ = ' ';
+  part_a[2] = bpr;
+  return o - out;
+}
+
+/* parse_ofs ****************************************************************/
+int parse_ofs (char const * s, uint64_t * ofs_p)
+{
+  uint64_t v = 0;
+  unsigned int d;
+
+  if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) s += 2;
+  if (!*s) return -1;
+  for (; *s; ++s)
+  {
+    if (*s >= '0' && *s <= '9') d = *s - '0';
+    else if ((*s | 0x20) >= 'a' && (*s | 0x20) <= 'f')
+      d = (*s | 0x20) - 'a' + 10;
+    else return -1;
+    if (v >> 60) return -1;
+    v = (v << 4) | d;
+  }
+  *ofs_p = v;
+  return 0;
+}
+
+/* hexview ******************************************************************/
+int hexview (hexview_t * hv, char const * name)
+{
+  char lbuf[0x200];
+  char ibuf[0x20];
+  acx1_event_t e;
+  uint8_t const * data;
+  uint64_t top, last_top, goto_ofs, v;
+  size_t part_a[3];
+  size_t len, room, n;
+  uint16_t w, h;
+  unsigned int rc, od, bpr, rows, r;
+  int line, ilen, prompt, err;
+
+  A(acx1_get_screen_size(&h, &w));
+  A(acx1_write_start());
+  A(acx1_attr(0, 7, 0));
+  A(acx1_clear());
+  A(acx1_write_stop());
+
+  // offset digits: enough for the last offset, at least 8
+  for (od = 8; od < 16 && hv->size && (hv->size - 1) >> (4 * od); ++od);
+
+  top = 0;
+  ilen = 0;
+  prompt = 0;
+  err = 0;
+  for (;;)
+  {
+    rows = h > 1 ? h - 1 : 1;
+    // the most bytes per row, in groups of 8, that fit the screen width
+    for (bpr = MAX_ROW_BYTES;
+         bpr > 8 && od + 2 + bpr * 3 + bpr / 8 + 1 + bpr > w; bpr -= 8);
+    top -= top % bpr;
+    last_top = hv->size ? (hv->size - 1) / bpr * bpr : 0;
+    last_top = last_top > (uint64_t) (rows - 1) * bpr
+      ? last_top - (uint64_t) (rows - 1) * bpr : 0;
+    if (top > last_top) top = last_top;
+
+    len = hv->size - top < (uint64_t) rows * bpr
+      ? (size_t) (hv->size - top) : (size_t) rows * bpr;
+    data = len ? hv_get(hv, top, len) : NULL;
+    if (len && !data) err = errno;
+
+    A(acx1_write_start());
+    for (r = 0; r < rows; ++r)
+    {
+      A(acx1_write_pos(r + 1, 1));
+      room = w;
+      if (data && (size_t) r * bpr < len)
+      {
+        n = len - (size_t) r * bpr;
+        if (n > bpr) n = bpr;
+        format_row(lbuf, top + (uint64_t) r * bpr, data + (size_t) r * bpr,
+                   n, od, bpr, part_a);
+        A(acx1_attr(ofs_bg, ofs_fg, 0));
+        A(put(lbuf, part_a[0], &room));
+        A(acx1_attr(hex_bg, hex_fg, 0));
+        A(put(lbuf + part_a[0], part_a[1], &room));
+        A(acx1_attr(txt_bg, txt_fg, 0));
+        A(put(lbuf + part_a[0] + part_a[1], part_a[2], &room));
+      }
+      else A(acx1_attr(hex_bg, hex_fg, 0));
+      if (room) { A(acx1_fill(' ', room)); }
+    }
+
+    A(acx1_write_pos(h, 1));
+    A(acx1_attr(bar_bg, bar_fg, 0));
+    if (prompt)
+      n = snprintf(lbuf, sizeof(lbuf), "Go to offset (hex): %s", ibuf);
+    else if (err)
+      n = snprintf(lbuf, sizeof(lbuf), "Error: cannot map offset 0x%llX (%s)",
+                   (unsigned long long) top, strerror(err));
+    else if (!hv->size)
+      n = snprintf(lbuf, sizeof(lbuf), "%s: empty file", name);
+    else
+      n = snprintf(lbuf, sizeof(lbuf), "%s: 0x%llX bytes, at 0x%llX (%u%%)"
+                   "  g: go to, q: quit",
+                   name, (unsigned long long) hv->size,
+                   (unsigned long long) top,
+                   (unsigned int) (last_top ? top * 100 / last_top : 100));
+    if (n >= sizeof(lbuf)) n = sizeof(lbuf) - 1;
+    room = w;
+    A(put(lbuf, n, &room));
+    if (room) { A(acx1_fill(' ', room)); }
+    A(acx1_write_stop());
+    if (prompt)
+    {
+      n = strlen("Go to offset (hex): ") + ilen + 1;
+      A(acx1_set_cursor_pos(h, n < w ? n : w));
+    }
+    else { A(acx1_set_cursor_pos(h, w)); }
+
+    A(acx1_read_event(&e));
+    if (e.type == ACX1_RESIZE)
+    {
+      w = e.size.w;
+      h = e.size.h;
+      continue;
+    }
+    if (e.type != ACX1_KEY) return -2;
+    err = 0;
+
+    if (prompt)
+    {
+      switch (e.km)
+      {
+      case ACX1_ESC:
+        prompt = 0;
+        break;
+      case ACX1_ENTER:
+      case ACX1_KP_ENTER:
+        prompt = 0;
+        if (!parse_ofs(ibuf, &goto_ofs))
+          top = goto_ofs < hv->size ? goto_ofs : (hv->size ? hv->size - 1 : 0);
+        break;
+      case ACX1_BACKSPACE:
+      case ACX1_CTRL | ACX1_BACKSPACE:
+        if (ilen) ibuf[--ilen] = 0;
+        break;
+      case ACX1_CTRL | 'U':
+        ibuf[ilen = 0] = 0;
+        break;
+      default:
+        if (e.km > 0x20 && e.km < 0x7F && ilen < (int) sizeof(ibuf) - 1)
+        {
+          ibuf[ilen++] = e.km;
+          ibuf[ilen] = 0;
+        }
+      }
+      continue;
+    }
+
+    v = (uint64_t) (rows > 1 ? rows - 1 : 1) * bpr;
+    switch (e.km)
+    {
+    case ACX1_ESC:
+    case 'q':
+    case ACX1_CTRL | 'Q':
+    case ACX1_CTRL | 'X':
+      return 0;
+    case 'g':
+    case ACX1_CTRL | 'G':
+      prompt = 1;
+      ibuf[ilen = 0] = 0;
+      break;
+    case ACX1_UP:
+    case 'k':
+      if (top >= bpr) top -= bpr;
+      break;
+    case ACX1_DOWN:
+    case 'j':
+      top += bpr;
+      break;
+    case ACX1_PAGE_UP:
+    case ACX1_CTRL | 'B':
+      top = top > v ? top - v : 0;
+      break;
+    case ACX1_PAGE_DOWN:
+    case ACX1_CTRL | 'F':
+    case ' ':
+      top = top + v < last_top ? top + v : last_top;
+      break;
+    case ACX1_HOME:
+    case ACX1_CTRL | ACX1_PAGE_UP:
+      top = 0;
+      break;
+    case ACX1_END:
+    case ACX1_CTRL | ACX1_PAGE_DOWN:
+      top = last_top;
+      break;
+    }
+  }
+
+l_acx_fail:
+  {
+    FILE * f = log_file ? log_file : stderr;
+    fprintf(f, "Error: %s (line %u)\n", acx1_status_str(rc), line);
+  }
+  return -2;
+}
+
+int main (int argc, char * * argv)
+{
+  unsigned int rc, line = 0;
+  hexview_t hv;
+  uint16_t w, h;
+  int i;
+
+  if (argc == 2 && !strcmp(argv[1], "-h"))
+  {
+    printf(
+      "Usage: hexview [-h] [-l ACX_LOG] FILE\n"
+      "Synopsis:  shows the contents of FILE in hex\n");
+    return 0;
+  }
+  if (argc == 4 && !strcmp(argv[1], "-l"))
+  {
+    log_file = fopen(argv[2], "wt");
+    argv += 2;
+    argc -= 2;
+  }
+  if (argc != 2)
+  {
+    fprintf(stderr, "Error: bad arguments (try -h)\n");
+    return 2;
+  }
+
+  if (log_file) acx1_logging(3, log_file);
+
+  if (hv_open(&hv, argv[1]))
+  {
+    fprintf(stderr, "Error: cannot open '%s' (%s, code %u)\n",
+            argv[1], strerror(errno), errno);
+    return 2;
+  }
+
+  A(acx1_init());
+  A(acx1_retained_mode(1));
+  i = hexview(&hv, argv[1]);
+  A(acx1_write_start());
+  A(acx1_attr(0, 7, 0));
+  A(acx1_clear());
+  A(acx1_write_stop());
+  A(acx1_get_screen_size(&h, &w));
+  A(acx1_set_cursor_pos(h, 1));
+  acx1_finish();
+  hv_close(&hv);
+
+  return i < 0 ? 1 : 0;
+l_acx_fail:
+  acx1_finish();
+  hv_close(&hv);
+  fprintf(stderr, "Error: %s (line %u)\n", acx1_status_str(rc), line);
+  return 2;
+}
@@ -34,6 +34,16 @@ int aw (char * str)
   return acx1_write(str, strlen(str));
 }
 
+/* terminal width of the first n bytes of the filter text */
+size_t fwidth (char const * str, size_t n)
+{
+  size_t b, c, w;
+
+  if (acx1_utf8_str_measure(acx1_term_char_width_wctx, NULL, str, n,
+                            SIZE_MAX, SIZE_MAX, &b, &c, &w) < 0) return n;
+  return w;
+}
+
 void * strstrci (char const * a, char const * b)
 {
   char ac, bc;
@@ -68,6 +78,7 @@ int linesel (char * * v, int n, char * init_str)
   uint16_t w, h, r;
   int line, rc, st;
   int i, opt_lines, first, crt, nleft, c, ilen, ipos;
+  uint32_t cp;
   int * xmap;
   char ichg;
 
@@ -163,7 +174,7 @@ int linesel (char * * v, int n, char * init_str)
     A(acx1_attr(0, 10, 0));
     A(aw(ibuf));
     A(acx1_attr(0, 7, 0));
-    c = strlen("Filter text: ") + ilen + 1;
+    c = strlen("Filter text: ") + fwidth(ibuf, ilen) + 1;
     if (c > w) c = w;
     A(acx1_fill(' ', w - c - 1));
     A(acx1_write_pos(opt_lines + 2, 1));
@@ -181,7 +192,8 @@ int linesel (char * * v, int n, char * init_str)
     A(acx1_write(obuf, c));
     A(acx1_fill(' ', w - c));
     A(acx1_write_stop());
-    A(acx1_set_cursor_pos(opt_lines + 1, strlen("Filter text: ") + ipos + 1));
+    A(acx1_set_cursor_pos(opt_lines + 1,
+                          strlen("Filter text: ") + fwidth(ibuf, ipos) + 1));
 
     A(acx1_read_event(&e));
     if (e.type == ACX1_RESIZE)
@@ -190,6 +202,30 @@ int linesel (char * * v, int n, char * init_str)
       h = e.size.h;
       continue;
     }
+    if (e.type == ACX1_PASTE)
+    {
+      // the filter is one line: take the text up to the first line break,
+      // leaving out controls and bad utf8
+      for (i = 0; (size_t) i < e.paste.len; i += c)
+      {
+        if (e.paste.data[i] == '\r' || e.paste.data[i] == '\n') break;
+        c = acx1_utf8_char_decode_strict(&e.paste.data[i],
+                                         e.paste.len - i, &cp);
+        if (c < 0) { c = 1; continue; }
+        if (cp < 0x20 || (cp >= 0x7F && cp < 0xA0)) continue;
+        if (ilen + c > (int) sizeof(ibuf) - 1) break;
+        if (ipos < ilen)
+        {
+          memmove(&ibuf[ipos + c], &ibuf[ipos], ilen - ipos);
+        }
+        memcpy(&ibuf[ipos], &e.paste.data[i], c);
+        ipos += c;
+        ilen += c;
+        ibuf[ilen] = 0;
+        ichg = 1;
+      }
+      continue;
+    }
     if (e.type != ACX1_KEY) return -2;
     switch (e.km)
     {
@@ -209,11 +245,13 @@ int linesel (char * * v, int n, char * init_str)
       break;
     case ACX1_LEFT:
     case ACX1_ALT | 'h':
-      if (ipos) ipos -= 1;
+      // the filter may have utf8 from pastes; move by whole chars
+      while (ipos && (ibuf[--ipos] & 0xC0) == 0x80);
       break;
     case ACX1_RIGHT:
     case ACX1_ALT | 'l':
-      if (ipos < ilen) ipos += 1;
+      if (ipos < ilen)
+        while (++ipos < ilen && (ibuf[ipos] & 0xC0) == 0x80);
       break;
     case ACX1_PAGE_UP:
     case ACX1_CTRL | 'B':
@@ -276,9 +314,10 @@ int linesel (char * * v, int n, char * init_str)
     case ACX1_CTRL | ACX1_BACKSPACE:
     case ACX1_BACKSPACE:
       if (!ipos) break;
-      --ipos;
-      memmove(&ibuf[ipos], &ibuf[ipos + 1], ilen - ipos);
-      --ilen;
+      for (i = ipos - 1; i && (ibuf[i] & 0xC0) == 0x80; --i);
+      memmove(&ibuf[i], &ibuf[ipos], ilen - ipos + 1);
+      ilen -= ipos - i;
+      ipos = i;
       ichg = 1;
       break;
     }
@@ -309,7 +348,8 @@ int main (int argc, char * * argv)
 {
   unsigned int rc, line = 0;
   static char lbuf[0x10002];
-  int i, l, n, a;
+  int i, n, a;
+  size_t l;
   char * * v;
   uint16_t w, h;
 
@@ -344,6 +384,9 @@ int main (int argc, char * * argv)
     }
     if (lbuf[l - 1] == '\n') lbuf[--l] = 0;
     if (!l) continue;
+    // kept and shown as bad when listed
+    if (acx1_utf8_validate(lbuf, l) != l)
+      fprintf(stderr, "Warning: line %u is not valid UTF-8\n", i);
     if (n == a)
     {
       a <<= 1;
@@ -363,6 +406,10 @@ int main (int argc, char * * argv)
   }
 
   A(acx1_init());
+  // without a retained grid (mswin) frames are drawn straight to the console
+  rc = acx1_retained_mode(1);
+  if (rc == ACX1_NOT_SUPPORTED) rc = 0;
+  A(rc);
   i = linesel(v, n, "");
   A(acx1_write_start());
   A(acx1_attr(0, 7, 0));
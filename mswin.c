@@ -8,9 +8,13 @@
  *  - 2013/01/17 Costin Ionescu: writing with WriteConsoleW so that wide-chars
  *    are printed ok
  */
+#include <string.h>
 #include <windows.h>
 #include "acx1.h"
 
+int rect_row_skip (uint8_t const * row, size_t len, size_t n, size_t * ofs_p,
+                   int * attr_p, int * split_p);
+
 static FILE * log_file = NULL;
 static int log_level = 0;
 static HANDLE hin, hout;
@@ -91,6 +95,42 @@ l_fail:
   return rc;
 }
 
+/* acx1_init_ex *************************************************************/
+/* the console input handle needs no worker thread, so flags change nothing */
+ACX1_API unsigned int ACX1_CALL acx1_init_ex (uint32_t flags)
+{
+  (void) flags;
+  return acx1_init();
+}
+
+/* acx1_get_input_fd ********************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_get_input_fd (int * fd_p)
+{
+  (void) fd_p;
+  return ACX1_NOT_SUPPORTED;
+}
+
+/* acx1_process_input *******************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_process_input ()
+{
+  return ACX1_NOT_SUPPORTED;
+}
+
+/* acx1_get_input_timeout ***************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_get_input_timeout (int * ms_p)
+{
+  (void) ms_p;
+  return ACX1_NOT_SUPPORTED;
+}
+
+/* acx1_set_esc_timeout *****************************************************/
+/* console input comes as key records, without escape sequences */
+ACX1_API unsigned int ACX1_CALL acx1_set_esc_timeout (unsigned int ms)
+{
+  (void) ms;
+  return 0;
+}
+
 /* acx1_finish **************************************************************/
 ACX1_API void ACX1_CALL acx1_finish ()
 {
@@ -98,95 +138,150 @@ ACX1_API void ACX1_CALL acx1_finish ()
   if (hout != INVALID_HANDLE_VALUE) CloseHandle(hout);
 }
 
-/* acx1_read_event **********************************************************/
-ACX1_API unsigned int ACX1_CALL acx1_read_event (acx1_event_t * event_p)
+/* decode_record ************************************************************/
+/* returns 1 if the record gave an event, 0 if it should be skipped */
+static int decode_record (INPUT_RECORD const * irp, acx1_event_t * event_p)
 {
-  INPUT_RECORD ir;
-  DWORD n;
+  INPUT_RECORD ir = *irp;
   uint16_t ch;
   uint32_t m;
 
-  for (;;)
+  if (ir.EventType == WINDOW_BUFFER_SIZE_EVENT)
   {
-    if (!ReadConsoleInputW(hin, &ir, 1, &n)) 
+    event_p->type = ACX1_RESIZE;
+    event_p->size.w = ir.Event.WindowBufferSizeEvent.dwSize.X;
+    event_p->size.h = ir.Event.WindowBufferSizeEvent.dwSize.Y;
+    LI("screen resized to %ux%u\n", event_p->size.w, event_p->size.h);
+    return 1;
+  }
+  if (ir.EventType == KEY_EVENT)
+  {
+    if (!ir.Event.KeyEvent.bKeyDown) return 0;
+    m = 0;
+    if (ir.Event.KeyEvent.dwControlKeyState & 
+        (LEFT_ALT_PRESSED | RIGHT_ALT_PRESSED))
+      m |= ACX1_ALT;
+    if (ir.Event.KeyEvent.dwControlKeyState & 
+        (LEFT_CTRL_PRESSED | RIGHT_CTRL_PRESSED))
+      m |= ACX1_CTRL;
+    if (ir.Event.KeyEvent.dwControlKeyState & SHIFT_PRESSED)
+      m |= ACX1_SHIFT;
+    event_p->type = ACX1_KEY;
+    ch = ir.Event.KeyEvent.uChar.UnicodeChar;
+    if (ch >= 0x20) 
+      event_p->km = (m & ~ACX1_SHIFT) | ir.Event.KeyEvent.uChar.UnicodeChar;
+    else //if (ch > 0)
     {
-        LE("read console input failed!\n");
-        return ACX1_TERM_IO_FAILED;
+
+      if (ch == 0x08 || ch == 0x09 || ch == 0x0D) m = ch;
+      else 
+      {
+        // event_p->km = ACX1_CTRL | 0x40 | ch;
+        switch (ch = ir.Event.KeyEvent.wVirtualKeyCode)
+        {
+        case VK_BACK:         m |= ACX1_BACKSPACE;            break;
+        case VK_TAB:          m |= ACX1_TAB;                  break;
+        case VK_RETURN:       m |= ACX1_ENTER;                break;
+        case VK_ESCAPE:       m |= ACX1_ESC;                  break;
+        case VK_SPACE:        m |= ACX1_SPACE;                break;
+        case VK_PRIOR:        m |= ACX1_PAGE_UP;              break;
+        case VK_NEXT:         m |= ACX1_PAGE_DOWN;            break;
+        case VK_END:          m |= ACX1_END;                  break;
+        case VK_HOME:         m |= ACX1_HOME;                 break;
+        case VK_LEFT:         m |= ACX1_LEFT;                 break;
+        case VK_UP:           m |= ACX1_UP;                   break;
+        case VK_RIGHT:        m |= ACX1_RIGHT;                break;
+        case VK_DOWN:         m |= ACX1_DOWN;                 break;
+        case VK_INSERT:       m |= ACX1_INS;                  break;
+        case VK_DELETE:       m |= ACX1_DEL;                  break;
+        case VK_F1:           m |= ACX1_F1;                   break;
+        case VK_F2:           m |= ACX1_F2;                   break;
+        case VK_F3:           m |= ACX1_F3;                   break;
+        case VK_F4:           m |= ACX1_F4;                   break;
+        case VK_F5:           m |= ACX1_F5;                   break;
+        case VK_F6:           m |= ACX1_F6;                   break;
+        case VK_F7:           m |= ACX1_F7;                   break;
+        case VK_F8:           m |= ACX1_F8;                   break;
+        case VK_F9:           m |= ACX1_F9;                   break;
+        case VK_F10:          m |= ACX1_F10;                  break;
+        case VK_F11:          m |= ACX1_F11;                  break;
+        case VK_F12:          m |= ACX1_F12;                  break;
+        default:
+          if ((ch >= '0' && ch <= '9') || 
+              (ch >= 'A' && ch <= 'Z')) m |= ch;
+          else return 0;
+        }
+      }
+
+      event_p->km = m;
     }
-    if (ir.EventType == WINDOW_BUFFER_SIZE_EVENT)
+    // else { event_p->km = '?'; }
+    LI("got key: 0x%X\n", event_p->km);
+    return 1;
+  }
+  return 0;
+}
+
+/* acx1_read_events *********************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_read_events
+(
+  acx1_event_t * events,
+  unsigned int max,
+  int timeout_ms,
+  unsigned int * count_p
+)
+{
+  INPUT_RECORD ir_a[0x40];
+  DWORD n, i, avail, start, el, w;
+  unsigned int c = 0, rc = 0;
+
+  start = GetTickCount();
+  while (c < max)
+  {
+    if (!GetNumberOfConsoleInputEvents(hin, &avail))
     {
-      event_p->type = ACX1_RESIZE;
-      event_p->size.w = ir.Event.WindowBufferSizeEvent.dwSize.X;
-      event_p->size.h = ir.Event.WindowBufferSizeEvent.dwSize.Y;
-      LI("screen resized to %ux%u\n", event_p->size.w, event_p->size.h);
-      return 0;
+      rc = ACX1_TERM_IO_FAILED;
+      break;
     }
-    if (ir.EventType == KEY_EVENT)
+    if (!avail)
     {
-      if (!ir.Event.KeyEvent.bKeyDown) continue;
-      m = 0;
-      if (ir.Event.KeyEvent.dwControlKeyState & 
-          (LEFT_ALT_PRESSED | RIGHT_ALT_PRESSED))
-        m |= ACX1_ALT;
-      if (ir.Event.KeyEvent.dwControlKeyState & 
-          (LEFT_CTRL_PRESSED | RIGHT_CTRL_PRESSED))
-        m |= ACX1_CTRL;
-      if (ir.Event.KeyEvent.dwControlKeyState & SHIFT_PRESSED)
-        m |= ACX1_SHIFT;
-      event_p->type = ACX1_KEY;
-      ch = ir.Event.KeyEvent.uChar.UnicodeChar;
-      if (ch >= 0x20) 
-        event_p->km = (m & ~ACX1_SHIFT) | ir.Event.KeyEvent.uChar.UnicodeChar;
-      else //if (ch > 0)
+      if (c) break;
+      w = INFINITE;
+      if (timeout_ms >= 0)
       {
-
-        if (ch == 0x08 || ch == 0x09 || ch == 0x0D) m = ch;
-        else 
-        {
-          // event_p->km = ACX1_CTRL | 0x40 | ch;
-          switch (ch = ir.Event.KeyEvent.wVirtualKeyCode)
-          {
-          case VK_BACK:         m |= ACX1_BACKSPACE;            break;
-          case VK_TAB:          m |= ACX1_TAB;                  break;
-          case VK_RETURN:       m |= ACX1_ENTER;                break;
-          case VK_ESCAPE:       m |= ACX1_ESC;                  break;
-          case VK_SPACE:        m |= ACX1_SPACE;                break;
-          case VK_PRIOR:        m |= ACX1_PAGE_UP;              break;
-          case VK_NEXT:         m |= ACX1_PAGE_DOWN;            break;
-          case VK_END:          m |= ACX1_END;                  break;
-          case VK_HOME:         m |= ACX1_HOME;                 break;
-          case VK_LEFT:         m |= ACX1_LEFT;                 break;
-          case VK_UP:           m |= ACX1_UP;                   break;
-          case VK_RIGHT:        m |= ACX1_RIGHT;                break;
-          case VK_DOWN:         m |= ACX1_DOWN;                 break;
-          case VK_INSERT:       m |= ACX1_INS;                  break;
-          case VK_DELETE:       m |= ACX1_DEL;                  break;
-          case VK_F1:           m |= ACX1_F1;                   break;
-          case VK_F2:           m |= ACX1_F2;                   break;
-          case VK_F3:           m |= ACX1_F3;                   break;
-          case VK_F4:           m |= ACX1_F4;                   break;
-          case VK_F5:           m |= ACX1_F5;                   break;
-          case VK_F6:           m |= ACX1_F6;                   break;
-          case VK_F7:           m |= ACX1_F7;                   break;
-          case VK_F8:           m |= ACX1_F8;                   break;
-          case VK_F9:           m |= ACX1_F9;                   break;
-          case VK_F10:          m |= ACX1_F10;                  break;
-          case VK_F11:          m |= ACX1_F11;                  break;
-          case VK_F12:          m |= ACX1_F12;                  break;
-          default:
-            if ((ch >= '0' && ch <= '9') || 
-                (ch >= 'A' && ch <= 'Z')) m |= ch;
-            else continue;
-          }
-        }
-
-        event_p->km = m;
+        el = GetTickCount() - start;
+        if (el >= (DWORD) timeout_ms) break;
+        w = timeout_ms - el;
       }
-      // else { event_p->km = '?'; }
-      LI("got key: 0x%X\n", event_p->km);
-      return 0;
+      w = WaitForSingleObject(hin, w);
+      if (w == WAIT_TIMEOUT) break;
+      if (w != WAIT_OBJECT_0) { rc = ACX1_TERM_IO_FAILED; break; }
+      continue;
+    }
+    // each record gives at most one event
+    n = max - c;
+    if (n > ACX1_ITEM_COUNT(ir_a)) n = ACX1_ITEM_COUNT(ir_a);
+    if (n > avail) n = avail;
+    if (!ReadConsoleInputW(hin, ir_a, n, &n))
+    {
+      LE("read console input failed!\n");
+      rc = ACX1_TERM_IO_FAILED;
+      break;
     }
+    for (i = 0; i < n; ++i) c += decode_record(&ir_a[i], &events[c]);
   }
+  *count_p = c;
+  return rc;
+}
+
+/* acx1_read_event **********************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_read_event (acx1_event_t * event_p)
+{
+  unsigned int rc, n;
+
+  rc = acx1_read_events(event_p, 1, -1, &n);
+  if (!rc && !n) rc = ACX1_TERM_IO_FAILED;
+  return rc;
 }
 
 /* acx1_set_cursor_mode *****************************************************/
@@ -264,6 +359,8 @@ static uint16_t ACX1_CALL prepare_attr (int bg, int fg, int mode)
 {
   uint16_t a;
   (void) mode;
+  if ((bg & ACX1_RGB)) bg = acx1_rgb_to_index(bg, 16);
+  if ((fg & ACX1_RGB)) fg = acx1_rgb_to_index(fg, 16);
   a = 0;
   if ((bg & 1)) a |= BACKGROUND_RED;
   if ((bg & 2)) a |= BACKGROUND_GREEN;
@@ -369,6 +466,63 @@ ACX1_API unsigned int ACX1_CALL acx1_clear ()
   return acx1_fill(' ', screen_height * screen_width);
 }
 
+/* acx1_clear_rect **********************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_clear_rect
+(
+  uint16_t r,
+  uint16_t c,
+  uint16_t h,
+  uint16_t w
+)
+{
+  COORD co;
+  DWORD n;
+  uint16_t i;
+
+  if (!r || !c || r > screen_height || c > screen_width) return 0;
+  if (h > screen_height - r + 1) h = screen_height - r + 1;
+  if (w > screen_width - c + 1) w = screen_width - c + 1;
+  co.X = c - 1;
+  for (i = 0; i < h; ++i)
+  {
+    co.Y = r - 1 + i;
+    if (!FillConsoleOutputCharacter(hout, ' ', w, co, &n))
+      return ACX1_TERM_IO_FAILED;
+    if (!FillConsoleOutputAttribute(hout, attr, w, co, &n))
+      return ACX1_TERM_IO_FAILED;
+  }
+  return 0;
+}
+
+/* acx1_scroll **************************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_scroll
+(
+  uint16_t top,
+  uint16_t bottom,
+  int n
+)
+{
+  SMALL_RECT sr;
+  COORD co;
+  CHAR_INFO ci;
+
+  if (bottom > screen_height) bottom = screen_height;
+  if (!top || top > bottom || !n) return 0;
+  if (n > bottom - top + 1) n = bottom - top + 1;
+  if (n < top - bottom - 1) n = top - bottom - 1;
+  sr.Left = 0;
+  sr.Right = screen_width - 1;
+  sr.Top = top - 1;
+  sr.Bottom = bottom - 1;
+  co.X = 0;
+  co.Y = top - 1 - n;
+  ci.Char.UnicodeChar = ' ';
+  ci.Attributes = attr;
+  if (!ScrollConsoleScreenBufferW(hout, &sr, &sr, co, &ci))
+    return ACX1_TERM_IO_FAILED;
+  return 0;
+}
+
 /* acx1_write_stop **********************************************************/
 ACX1_API unsigned int ACX1_CALL acx1_write_stop ()
 {
@@ -391,15 +545,66 @@ ACX1_API unsigned int ACX1_CALL acx1_rect
   uint16_t col_num,
   acx1_attr_t * attrs
 )
+{
+  return acx1_rect_ofs(data, start_row, start_col, row_num, col_num, 0, attrs);
+}
+
+/* acx1_rect_ofs ************************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_rect_ofs
+(
+  uint8_t const * const * data,
+  uint16_t start_row,
+  uint16_t start_col,
+  uint16_t row_num,
+  uint16_t col_num,
+  uint32_t col_ofs,
+  acx1_attr_t * attrs
+)
+{
+  acx1_row_t rows[0x40];
+  uint_t i, k, n, rc;
+
+  for (i = 0; i < row_num && start_row + i <= 0xFFFF; i += n)
+  {
+    n = row_num - i < ACX1_ITEM_COUNT(rows) ? row_num - i
+                                            : ACX1_ITEM_COUNT(rows);
+    for (k = 0; k < n; ++k)
+    {
+      rows[k].data = data[i + k];
+      rows[k].len = strlen((char const *) data[i + k]);
+    }
+    rc = acx1_rect_rows(rows, NULL, start_row + i, start_col, n, col_num,
+                        col_ofs, attrs);
+    if (rc) return rc;
+  }
+  return 0;
+}
+
+/* acx1_rect_rows ***********************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_rect_rows
+(
+  acx1_row_t const * rows,
+  uint32_t const * widths,
+  uint16_t start_row,
+  uint16_t start_col,
+  uint16_t row_num,
+  uint16_t col_num,
+  uint32_t col_ofs,
+  acx1_attr_t * attrs
+)
 {
   CHAR_INFO buf[0x2000];
   CHAR_INFO * ci;
   SMALL_RECT wr;
   COORD bs, bc;
-  uint_t i, j, o, crt_attr, buf_rows;
-  int l, cw;
+  uint_t i, j, buf_rows;
+  size_t o, len;
+  int l, cw, crt_attr, split;
   uint16_t a;
   uint32_t cp;
+  uint8_t const * row;
+
+  (void) widths; // every char is decoded into the cell buffer anyway
 
 
   start_row--; start_col--;
@@ -411,20 +616,34 @@ ACX1_API unsigned int ACX1_CALL acx1_rect
   bs.X = col_num;
   bc.X = 0;
   bc.Y = 0;
-  for (; row_num; row_num -= buf_rows, start_row += buf_rows, data += buf_rows)
+  for (; row_num; row_num -= buf_rows, start_row += buf_rows, rows += buf_rows)
   {
     if (row_num < buf_rows) buf_rows = row_num;
     for (ci = &buf[0], i = 0; i < buf_rows; ++i)
     {
+      row = rows[i].data;
+      len = rows[i].len;
       crt_attr = 0;
+      o = 0;
+      split = 0;
+      if (col_ofs && rect_row_skip(row, len, col_ofs, &o, &crt_attr, &split))
+        return ACX1_BAD_DATA;
       a = prepare_attr(attrs[crt_attr].bg, attrs[crt_attr].fg, 
                        attrs[crt_attr].mode);
 
-      for (j = o = 0; data[i][o] && j < col_num; o += l, j += cw, ci += cw)
+      j = 0;
+      if (split)
       {
-        if (data[i][o] >= 0x80)
+        ci->Char.UnicodeChar = ' ';
+        ci->Attributes = a;
+        ++ci;
+        j = 1;
+      }
+      for (; o < len && j < col_num; o += l, j += cw, ci += cw)
+      {
+        if (row[o] >= 0x80)
         {
-          l = acx1_utf8_char_decode_strict(data[i] + o, SSIZE_MAX, &cp);
+          l = acx1_utf8_char_decode_strict(row + o, len - o, &cp);
           if (l < 0) return ACX1_BAD_DATA;
           cw = acx1_term_char_width(cp);
           if (cw < 0) return ACX1_BAD_DATA;
@@ -438,10 +657,11 @@ ACX1_API unsigned int ACX1_CALL acx1_rect
         }
         else 
         { 
-          cp = data[i][o];
+          cp = row[o];
           if (cp == '\a')
           {
-            crt_attr = data[i][o + 1];
+            if (len - o < 2) break;
+            crt_attr = row[o + 1];
             a = prepare_attr(attrs[crt_attr].bg, attrs[crt_attr].fg, 
                              attrs[crt_attr].mode);
             cw = 0;
@@ -477,4 +697,44 @@ ACX1_API unsigned int ACX1_CALL acx1_rect
   return 0;
 }
 
+/* acx1_retained_mode *******************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_retained_mode (unsigned int enable)
+{
+  // the console keeps its own cell buffer; writes are already retained
+  return enable ? ACX1_NOT_SUPPORTED : 0;
+}
+
+/* acx1_present *************************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_present ()
+{
+  return ACX1_NOT_SUPPORTED;
+}
+
+/* acx1_flush ***************************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_flush ()
+{
+  return 0;
+}
+
+/* acx1_get_caps ************************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_get_caps (uint32_t * caps_p)
+{
+  // the console api needs no escape sequences
+  *caps_p = 0;
+  return 0;
+}
+
+/* acx1_set_caps ************************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_set_caps (uint32_t caps)
+{
+  return caps ? ACX1_NOT_SUPPORTED : 0;
+}
+
+/* acx1_get_stats ***********************************************************/
+ACX1_API unsigned int ACX1_CALL acx1_get_stats (acx1_stats_t * stats_p)
+{
+  memset(stats_p, 0, sizeof(*stats_p));
+  return ACX1_NOT_SUPPORTED;
+}
+
 #endif
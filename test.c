@@ -111,6 +111,9 @@ int main (int argc, char const * const * argv)
       w = e.size.w;
       h = e.size.h;
       break;
+    case ACX1_PASTE:
+      sprintf(buf, "paste: %lu bytes", (unsigned long) e.paste.len);
+      break;
     case ACX1_ERROR:
       sprintf(buf, "error event");
       goto l_exit;
@@ -1,3 +1,6 @@
+/* terminal widths for acx1_term_char_width(); this table predates ucwgen
+ * and is not from a named UCD release yet: regenerate it from the official
+ * files with `make ucw8 UCD_DIR=<dir>` (see ucwgen.c) */
 
 unsigned char acx1_ucw_ofs_a[] = {
     0,  1,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
@@ -0,0 +1,199 @@
+/* acx1 - Application Console Interface - ver. 1
+ *
+ * Generator for ucw8.c, the table of terminal widths used by
+ * acx1_term_char_width().
+ *
+ * Usage: ucwgen UnicodeData.txt EastAsianWidth.txt > ucw8.c
+ *
+ * Both files come from the Unicode Character Database of the same version
+ * (https://www.unicode.org/Public/UCD/latest/ucd/). Widths are assigned as:
+ *  - code points in UnicodeData.txt (First/Last ranges included) get 1;
+ *  - by general category, non-spacing and enclosing marks (Mn, Me) get 0 and
+ *    control, format and surrogate code points (Cc, Cf, Cs) have no width;
+ *  - the ones left with 1 get 2 if EastAsianWidth.txt has them as W or F;
+ *  - code points missing from UnicodeData.txt have no width, whatever
+ *    EastAsianWidth.txt says about them (it gives reserved CJK ranges W).
+ *
+ * The output has 2 bits for each code point (3 meaning no width) in blocks of
+ * 256 code points; identical blocks are stored once and acx1_ucw_ofs_a holds
+ * the block index for each 256 code points.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CP_NUM 0x110000
+#define BLOCK_CPS 0x100
+#define BLOCK_SIZE (BLOCK_CPS / 4)
+#define BLOCK_NUM (CP_NUM / BLOCK_CPS)
+
+static unsigned char width_a[CP_NUM];
+static unsigned char val_a[BLOCK_NUM * BLOCK_SIZE];
+static unsigned char ofs_a[BLOCK_NUM];
+static char version[0x40] = "unknown";
+
+/* parse_range **************************************************************/
+/* parses "XXXX" or "XXXX..YYYY"; returns the text after it or NULL */
+static char * parse_range (char * s, unsigned long * a, unsigned long * b)
+{
+  char * e;
+
+  *a = strtoul(s, &e, 16);
+  if (e == s) return NULL;
+  *b = *a;
+  if (e[0] == '.' && e[1] == '.')
+  {
+    s = e + 2;
+    *b = strtoul(s, &e, 16);
+    if (e == s) return NULL;
+  }
+  if (*a > *b || *b >= CP_NUM) return NULL;
+  return e;
+}
+
+/* set_width ****************************************************************/
+static void set_width (unsigned long a, unsigned long b, int w)
+{
+  for (; a <= b; ++a) width_a[a] = w;
+}
+
+/* load_eaw *****************************************************************/
+static int load_eaw (char const * path)
+{
+  FILE * f;
+  char line[0x200];
+  char * s;
+  char * v;
+  unsigned long a, b;
+  unsigned int ln = 0;
+
+  f = fopen(path, "r");
+  if (!f) { perror(path); return 1; }
+  while (fgets(line, sizeof(line), f))
+  {
+    ++ln;
+    // the first line names the file with its version: "# EastAsianWidth-X.txt"
+    if (ln == 1 && (s = strstr(line, "EastAsianWidth-")) &&
+        (v = strstr(s, ".txt")))
+    {
+      s += strlen("EastAsianWidth-");
+      if (v - s < (int) sizeof(version))
+      {
+        memcpy(version, s, v - s);
+        version[v - s] = 0;
+      }
+    }
+    if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') continue;
+    s = parse_range(line, &a, &b);
+    if (!s) goto l_bad;
+    while (*s == ' ') ++s;
+    if (*s++ != ';') goto l_bad;
+    while (*s == ' ') ++s;
+    if (*s != 'W' && *s != 'F') continue;
+    // only assigned code points with no other width from load_ud()
+    for (; a <= b; ++a)
+      if (width_a[a] == 1) width_a[a] = 2;
+  }
+  fclose(f);
+  return 0;
+l_bad:
+  fprintf(stderr, "%s:%u: bad line\n", path, ln);
+  fclose(f);
+  return 1;
+}
+
+/* load_ud ******************************************************************/
+static int load_ud (char const * path)
+{
+  FILE * f;
+  char line[0x400];
+  char * name;
+  char * cat;
+  char * s;
+  unsigned long a, b, first = 0;
+  unsigned int ln = 0;
+
+  f = fopen(path, "r");
+  if (!f) { perror(path); return 1; }
+  while (fgets(line, sizeof(line), f))
+  {
+    ++ln;
+    s = parse_range(line, &a, &b);
+    if (!s || *s != ';') goto l_bad;
+    name = s + 1;
+    s = strchr(name, ';');
+    if (!s) goto l_bad;
+    *s = 0;
+    cat = s + 1;
+    if (!strchr(cat, ';')) goto l_bad;
+    // big ranges are listed as a pair of <..., First> and <..., Last> lines
+    if (strstr(name, ", First>")) { first = a; continue; }
+    if (strstr(name, ", Last>")) a = first;
+    if (!strncmp(cat, "Mn;", 3) || !strncmp(cat, "Me;", 3)) set_width(a, b, 0);
+    else if (!strncmp(cat, "Cc;", 3) || !strncmp(cat, "Cf;", 3) ||
+             !strncmp(cat, "Cs;", 3)) set_width(a, b, 3);
+    else set_width(a, b, 1);
+  }
+  fclose(f);
+  return 0;
+l_bad:
+  fprintf(stderr, "%s:%u: bad line\n", path, ln);
+  fclose(f);
+  return 1;
+}
+
+/* pack *********************************************************************/
+/* returns the number of distinct blocks or 0 if they do not fit the index */
+static unsigned int pack ()
+{
+  unsigned char blk[BLOCK_SIZE];
+  unsigned int i, j, n = 0;
+
+  for (i = 0; i < BLOCK_NUM; ++i)
+  {
+    memset(blk, 0, sizeof(blk));
+    for (j = 0; j < BLOCK_CPS; ++j)
+      blk[j >> 2] |= width_a[i * BLOCK_CPS + j] << (2 * (j & 3));
+    for (j = 0; j < n && memcmp(&val_a[j * BLOCK_SIZE], blk, BLOCK_SIZE); ++j);
+    if (j == n)
+    {
+      if (n == 0x100) return 0;
+      memcpy(&val_a[n++ * BLOCK_SIZE], blk, BLOCK_SIZE);
+    }
+    ofs_a[i] = j;
+  }
+  return n;
+}
+
+/* main *********************************************************************/
+int main (int argc, char const * const * argv)
+{
+  unsigned int i, n;
+
+  if (argc != 3)
+  {
+    fprintf(stderr, "usage: %s UnicodeData.txt EastAsianWidth.txt > ucw8.c\n",
+            argv[0]);
+    return 1;
+  }
+  memset(width_a, 3, sizeof(width_a));
+  // the east asian widths apply only to what UnicodeData.txt assigns
+  if (load_ud(argv[1]) || load_eaw(argv[2])) return 2;
+  n = pack();
+  if (!n)
+  {
+    fprintf(stderr, "too many distinct blocks\n");
+    return 2;
+  }
+
+  printf("/* generated by ucwgen from Unicode %s data; do not edit */\n",
+         version);
+  printf("unsigned char acx1_ucw_ofs_a[] = {");
+  for (i = 0; i < BLOCK_NUM; ++i)
+    printf("%s%3u,", i % 16 ? "" : "\n  ", ofs_a[i]);
+  printf("\n};\n\nunsigned char acx1_ucw_val_a[] = {");
+  for (i = 0; i < n * BLOCK_SIZE; ++i)
+    printf("%s%3u,", i % BLOCK_SIZE ? "" : "\n  ", val_a[i]);
+  printf("\n};\n\n");
+  return 0;
+}